@@ -2,6 +2,7 @@
 // Called from 16-bit stub after switching to protected mode
 
 #include <stdint.h>
+#include "string_ops.h"
 
 // VGA text mode memory
 #define VGA_MEMORY 0xB8000
@@ -26,13 +27,13 @@ void stage2_c_main(void) {
     
     // Copy kernel from 0x20000 (temporary buffer) to 0x100000 (1MB)
     vga_print_debug("Copying kernel...", 2);
-    memcpy((void*)0x100000, (void*)0x20000, 64 * 512);  // Copy 64 sectors
+    memcpy((void*)0x100000, (void*)0x20000, 128 * 512);  // Copy 128 sectors (64KB)
     
-    // Copy Userspace Init + Drivers from 0x28000 (0x20000 + 32KB) to 0x400000 (4MB)
+    // Copy Userspace Init + Drivers from 0x30000 (0x20000 + 64KB) to 0x400000 (4MB)
     // We loaded ~255 sectors in stub, but let's copy a generous amount to 4MB region
     vga_print_debug("Copying userspace...", 3);
     memset((void*)0x400000, 0, 1024 * 1024); // Zero 1MB first
-    memcpy((void*)0x400000, (void*)(0x20000 + (64 * 512)), 512 * 512); // Copy 512 sectors (256KB)
+    memcpy((void*)0x400000, (void*)(0x20000 + (128 * 512)), 512 * 512); // Copy 512 sectors (256KB)
     
     
     // Verify kernel was loaded
@@ -67,19 +68,12 @@ void stage2_c_main(void) {
 
 // Simple memory functions
 void* memcpy(void* dest, const void* src, uint32_t n) {
-    uint8_t* d = (uint8_t*)dest;
-    const uint8_t* s = (const uint8_t*)src;
-    while (n--) {
-        *d++ = *s++;
-    }
+    string_copy(dest, src, n);
     return dest;
 }
 
 void* memset(void* s, int c, uint32_t n) {
-    uint8_t* p = (uint8_t*)s;
-    while (n--) {
-        *p++ = (uint8_t)c;
-    }
+    string_fill(s, (uint8_t)c, n);
     return s;
 }
 
@@ -4,6 +4,11 @@
 
 LOAD_ADDR equ 0x10000
 
+; Boot info block handed to the kernel (see include/boot_info.h)
+BOOT_INFO_ADDR  equ 0x8000
+BOOT_INFO_MAGIC equ 0x464E4942
+BOOT_E820_MAX   equ 32
+
 start:
     ; Setup segments
     mov ax, 0x1000
@@ -30,8 +35,9 @@ start:
     mov es, ax
     xor bx, bx
     
-    ; Read 512 sectors using single-sector reads (Slow but robust for Floppy)
-    mov cx, 512
+    ; Read 576 sectors using single-sector reads (Slow but robust for Floppy):
+    ; 128 for the kernel, then 64 for each of the 7 boot modules
+    mov cx, 576
     mov bp, 10          ; Start LBA 10
     
 read_loop:
@@ -72,6 +78,9 @@ read_loop:
     mov si, msg_kernel_loaded
     call print
     
+    ; Collect the BIOS memory map while BIOS services are still available
+    call e820_detect
+    
     ; Enable A20
     in al, 0x92
     or al, 2
@@ -150,6 +159,42 @@ disk_error:
     jmp .hang
 
 [BITS 16]
+; Fill the boot info block with INT 15h/E820 entries
+e820_detect:
+    push es
+    xor ax, ax
+    mov es, ax
+    mov dword [es:BOOT_INFO_ADDR], 0        ; Invalid until the map is complete
+    mov di, BOOT_INFO_ADDR + 8
+    xor ebx, ebx
+    xor bp, bp                              ; Entry count
+.next:
+    mov eax, 0xE820
+    mov edx, 0x534D4150                     ; 'SMAP'
+    mov ecx, 24
+    mov dword [es:di + 20], 1               ; Valid ACPI attributes if the BIOS only writes 20 bytes
+    int 0x15
+    jc .done
+    cmp eax, 0x534D4150
+    jne .done
+    jcxz .skip                              ; Ignore empty entries
+    inc bp
+    add di, 24
+    cmp bp, BOOT_E820_MAX
+    jae .done
+.skip:
+    test ebx, ebx
+    jnz .next
+.done:
+    test bp, bp
+    jz .out                                 ; No map: the kernel falls back to its defaults
+    mov [es:BOOT_INFO_ADDR + 4], bp
+    mov word [es:BOOT_INFO_ADDR + 6], 0
+    mov dword [es:BOOT_INFO_ADDR], BOOT_INFO_MAGIC
+.out:
+    pop es
+    ret
+
 print:
     lodsb
     test al, al
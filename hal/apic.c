@@ -0,0 +1,94 @@
+// HAL Local APIC Module
+// Local APIC setup and its timer, in one-shot or TSC-deadline mode
+
+#include "hal.h"
+#include "types.h"
+#include <stddef.h>
+
+// Register offsets from the APIC base
+#define APIC_REG_TPR         0x080
+#define APIC_REG_EOI         0x0B0
+#define APIC_REG_SVR         0x0F0
+#define APIC_REG_LVT_TIMER   0x320
+#define APIC_REG_LVT_LINT0   0x350
+#define APIC_REG_TIMER_INIT  0x380
+#define APIC_REG_TIMER_COUNT 0x390
+#define APIC_REG_TIMER_DIV   0x3E0
+
+#define APIC_BASE_X2APIC     0x400       // IA32_APIC_BASE: x2APIC mode, no MMIO window
+#define APIC_BASE_ENABLE     0x800       // IA32_APIC_BASE: global enable
+#define APIC_SVR_ENABLE      0x100       // Software enable
+#define APIC_LVT_MASKED      0x10000
+#define APIC_LVT_EXTINT      0x700       // Delivery mode for the 8259 (virtual wire)
+#define APIC_TIMER_ONESHOT   0x00000
+#define APIC_TIMER_DEADLINE  0x40000
+#define APIC_TIMER_DIV_16    0x03
+
+static volatile uint32_t* apic_regs = NULL;
+
+static inline uint32_t apic_read(uint32_t reg) {
+    return apic_regs[reg / 4];
+}
+
+static inline void apic_write(uint32_t reg, uint32_t value) {
+    apic_regs[reg / 4] = value;
+}
+
+// Enable the local APIC with its timer stopped. The 8259 keeps delivering
+// through LINT0, so the other IRQs are unaffected.
+bool hal_apic_init(void) {
+    extern uint32_t memory_map_mmio(uint32_t phys_addr);
+
+    if (!(hal_cpu_get_features() & CPU_FEAT_APIC)) {
+        return false;
+    }
+    uint64_t msr = hal_cpu_read_msr(MSR_APIC_BASE);
+    uint32_t base = (uint32_t)msr;
+    if ((msr >> 32) || (base & APIC_BASE_X2APIC)) {
+        return false;
+    }
+    uint32_t virt = memory_map_mmio(base & ~0xFFF);
+    if (!virt) {
+        return false;
+    }
+    hal_cpu_write_msr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+    apic_regs = (volatile uint32_t*)virt;
+
+    apic_write(APIC_REG_TPR, 0);
+    apic_write(APIC_REG_LVT_LINT0, APIC_LVT_EXTINT);
+    apic_write(APIC_REG_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    apic_write(APIC_REG_TIMER_DIV, APIC_TIMER_DIV_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TIMER_INIT, 0);
+    return true;
+}
+
+// Acknowledge an interrupt the local APIC delivered itself
+void hal_apic_eoi(void) {
+    apic_write(APIC_REG_EOI, 0);
+}
+
+// Unmask the timer, counting down (hal_apic_timer_oneshot) or comparing
+// against the TSC (hal_apic_timer_deadline)
+void hal_apic_timer_enable(bool tsc_deadline) {
+    apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_VECTOR | (tsc_deadline ? APIC_TIMER_DEADLINE : APIC_TIMER_ONESHOT));
+    if (tsc_deadline) {
+        // The mode change must land before the first deadline write
+        __asm__ volatile("mfence" : : : "memory");
+    }
+}
+
+// Interrupt after count timer clocks; 0 stops the timer
+void hal_apic_timer_oneshot(uint32_t count) {
+    apic_write(APIC_REG_TIMER_INIT, count);
+}
+
+// Interrupt once the TSC reaches tsc; 0 disarms
+void hal_apic_timer_deadline(uint64_t tsc) {
+    hal_cpu_write_msr(MSR_TSC_DEADLINE, tsc);
+}
+
+// Timer clocks left in the current one-shot
+uint32_t hal_apic_timer_current(void) {
+    return apic_read(APIC_REG_TIMER_COUNT);
+}
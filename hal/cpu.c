@@ -7,13 +7,6 @@
 // CPU feature flags
 static uint32_t cpu_features = 0;
 
-// CPU feature bits
-#define CPU_FEAT_FPU    0x00000001
-#define CPU_FEAT_MMX    0x00000002
-#define CPU_FEAT_SSE    0x00000004
-#define CPU_FEAT_SSE2   0x00000008
-#define CPU_FEAT_APIC   0x00000010
-
 // Initialize CPU module
 void hal_cpu_init(void) {
     cpu_features = hal_cpu_get_features();
@@ -60,6 +53,30 @@ uint32_t hal_cpu_get_features(void) {
     if (edx & (1 << 25))  features |= CPU_FEAT_SSE;
     if (edx & (1 << 26))  features |= CPU_FEAT_SSE2;
     if (edx & (1 << 9))   features |= CPU_FEAT_APIC;
+    if (edx & (1 << 4))   features |= CPU_FEAT_TSC;
+    if (edx & (1 << 13))  features |= CPU_FEAT_PGE;
+    if (edx & (1 << 3))   features |= CPU_FEAT_PSE;
+    if (edx & (1 << 6))   features |= CPU_FEAT_PAE;
+    if (ecx & (1 << 24))  features |= CPU_FEAT_TSC_DEADLINE;
+    
+    // NX is reported in the extended feature leaf
+    __asm__ volatile(
+        "mov $0x80000000, %%eax\n"
+        "cpuid"
+        : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+        :
+        : "memory"
+    );
+    if (eax >= 0x80000001) {
+        __asm__ volatile(
+            "mov $0x80000001, %%eax\n"
+            "cpuid"
+            : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+            :
+            : "memory"
+        );
+        if (edx & (1 << 20))  features |= CPU_FEAT_NX;
+    }
     
     return features;
 }
@@ -71,9 +88,9 @@ void hal_cpu_enable_paging(uint32_t page_dir) {
     // Set page directory base
     hal_cpu_set_cr3(page_dir);
     
-    // Enable paging in CR0
+    // Enable paging in CR0; WP makes kernel writes to user buffers honor copy-on-write
     __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
-    cr0 |= CR0_PG;
+    cr0 |= CR0_PG | CR0_WP;
     __asm__ volatile("mov %0, %%cr0" : : "r"(cr0));
 }
 
@@ -91,7 +108,7 @@ void hal_cpu_halt(void) {
 uint64_t hal_cpu_get_cycles(void) {
     uint32_t low, high;
     
-    if (cpu_features & CPU_FEAT_APIC) {
+    if (cpu_features & CPU_FEAT_TSC) {
         __asm__ volatile(
             "rdtsc"
             : "=a"(low), "=d"(high)
@@ -134,6 +151,83 @@ void hal_cpu_flush_tlb(void) {
     );
 }
 
+// Get current CR4 register
+uint32_t hal_cpu_get_cr4(void) {
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+// Set CR4 register
+void hal_cpu_set_cr4(uint32_t cr4) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+// Enable global pages (CR4.PGE) if the CPU supports them
+bool hal_cpu_enable_global_pages(void) {
+    if (!(cpu_features & CPU_FEAT_PGE)) {
+        return false;
+    }
+    hal_cpu_set_cr4(hal_cpu_get_cr4() | CR4_PGE);
+    return true;
+}
+
+// Enable 4MB pages (CR4.PSE) if the CPU supports them
+bool hal_cpu_enable_large_pages(void) {
+    if (!(cpu_features & CPU_FEAT_PSE)) {
+        return false;
+    }
+    hal_cpu_set_cr4(hal_cpu_get_cr4() | CR4_PSE);
+    return true;
+}
+
+// Enable PAE paging (CR4.PAE) if the CPU supports it; paging must still be off
+bool hal_cpu_enable_pae(void) {
+    if (!(cpu_features & CPU_FEAT_PAE)) {
+        return false;
+    }
+    hal_cpu_set_cr4(hal_cpu_get_cr4() | CR4_PAE);
+    return true;
+}
+
+// Enable no-execute pages (EFER.NXE) if the CPU supports them; PAE entries only
+bool hal_cpu_enable_nx(void) {
+    if (!(cpu_features & CPU_FEAT_NX)) {
+        return false;
+    }
+    hal_cpu_write_msr(MSR_EFER, hal_cpu_read_msr(MSR_EFER) | EFER_NXE);
+    return true;
+}
+
+// Read a model specific register
+uint64_t hal_cpu_read_msr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Write a model specific register
+void hal_cpu_write_msr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Flush the whole TLB including global entries
+void hal_cpu_flush_tlb_global(void) {
+    uint32_t cr4 = hal_cpu_get_cr4();
+    if (cr4 & CR4_PGE) {
+        // Toggling PGE drops every entry, global or not
+        hal_cpu_set_cr4(cr4 & ~CR4_PGE);
+        hal_cpu_set_cr4(cr4);
+    } else {
+        hal_cpu_flush_tlb();
+    }
+}
+
+// Invalidate the TLB entry for a single page
+void hal_cpu_invlpg(uint32_t addr) {
+    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
 // Enable/disable interrupts
 void hal_cpu_enable_interrupts(void) {
     __asm__ volatile("sti");
@@ -8,6 +8,7 @@
 #define PIC_EOI     0x20
 #define PIC_INIT    0x11
 #define PIC_ICW4_8086 0x01
+#define PIC_READ_IRR  0x0A
 
 // Initialize PIC controllers
 void hal_pic_init(void) {
@@ -59,6 +60,12 @@ void hal_pic_send_eoi(uint8_t irq) {
     hal_outb(PORT_PIC_MASTER_CMD, PIC_EOI);
 }
 
+// Whether an IRQ has been raised but not yet delivered (master PIC only)
+bool hal_pic_irq_pending(uint8_t irq) {
+    hal_outb(PORT_PIC_MASTER_CMD, PIC_READ_IRR);
+    return (hal_inb(PORT_PIC_MASTER_CMD) & (1 << irq)) != 0;
+}
+
 // Mask specific IRQ line
 void hal_pic_mask_irq(uint8_t irq) {
     uint16_t port;
@@ -6,42 +6,197 @@
 
 // Timer configuration
 static uint32_t timer_frequency = 100;  // Default 100 Hz
+static uint32_t timer_divisor = 0;      // PIT input cycles per tick
 static uint32_t timer_ticks = 0;
+static uint32_t oneshot_ticks = 0;      // Ticks the armed one-shot stands for, 0 while periodic
+
+// Clock events. The PIT only interrupts on tick boundaries. The local APIC
+// backends program one interrupt at a time, for the next tick or an earlier
+// event, and keep time with the TSC.
+typedef enum {
+    CLOCK_PIT,
+    CLOCK_APIC,          // Local APIC timer counting down
+    CLOCK_TSC_DEADLINE   // Local APIC timer firing at a TSC value
+} clock_source_t;
+
+static clock_source_t clock_source = CLOCK_PIT;
+static uint32_t tick_us = 10000;        // Microseconds per tick
+static uint32_t next_tick_us = 0;       // Clock time the next tick is due at
+static uint32_t event_us = 0;           // Clock time of the requested event
+static bool event_pending = false;
+static bool tick_stopped = false;       // Idle: only the event is programmed
+static uint32_t armed_us = 0;           // Clock time the hardware is programmed for
+static bool armed = false;
+static uint64_t tsc_base = 0;           // TSC at clock time 0
+static uint32_t tsc_to_us = 0;          // Microseconds per TSC cycle, 0.32 fixed point
+static uint32_t us_to_tsc = 0;          // TSC cycles per microsecond, 20.12 fixed point
+static uint32_t us_to_apic = 0;         // APIC timer clocks per microsecond, 20.12 fixed point
 
 // PIT (Programmable Interval Timer) constants
 #define PIT_FREQUENCY   1193180
+#define PIT_MAX_COUNT   0xFFFF
+#define PIT_MODE_ONESHOT  0x30  // Channel 0, lo/hi byte, mode 0 (interrupt on terminal count)
+#define PIT_MODE_PERIODIC 0x34  // Channel 0, lo/hi byte, mode 2 (rate generator)
+#define PIT_LATCH         0x00  // Channel 0 counter latch
 #define TIMER_IRQ       0
 
+#define CALIBRATE_PIT_COUNT 11932   // PIT cycles the calibration runs for, about 10ms
+#define IDLE_MAX_US 1000000         // Longest stretch without a tick on the APIC backends
+
+// Forward declarations
+static void pit_program(uint8_t mode, uint32_t count);
+static uint32_t pit_read_count(void);
+static bool clock_calibrate(void);
+static void clock_advance(uint32_t now);
+static void clock_arm(uint32_t now);
+
 // Initialize timer
 void hal_timer_init(uint32_t frequency) {
     timer_frequency = frequency;
     
+    // The local APIC timer takes over when there is a TSC to keep time with;
+    // IRQ0 then stays masked
+    uint32_t features = hal_cpu_get_features();
+    if ((features & CPU_FEAT_TSC) && hal_apic_init() && clock_calibrate()) {
+        clock_source = (features & CPU_FEAT_TSC_DEADLINE) ? CLOCK_TSC_DEADLINE : CLOCK_APIC;
+        hal_apic_timer_enable(clock_source == CLOCK_TSC_DEADLINE);
+        tsc_base = hal_cpu_get_cycles();
+    }
+    
     // Set timer frequency
     hal_timer_set_frequency(frequency);
     
     // Enable timer interrupt
-    hal_timer_enable_irq();
+    if (clock_source == CLOCK_PIT) {
+        hal_timer_enable_irq();
+    }
 }
 
 // Set timer frequency
 void hal_timer_set_frequency(uint32_t hz) {
-    uint32_t divisor = PIT_FREQUENCY / hz;
+    tick_us = 1000000 / hz;
+    if (clock_source != CLOCK_PIT) {
+        // The tick is a one-shot, re-armed from each interrupt
+        uint32_t now = hal_timer_get_us();
+        next_tick_us = now + tick_us;
+        armed = false;
+        clock_arm(now);
+        timer_frequency = hz;
+        return;
+    }
     
-    // Command byte: channel 0, square wave, access both, 16-bit
-    hal_outb(PORT_TIMER_CMD, 0x36);
+    timer_divisor = PIT_FREQUENCY / hz;
     
-    // Send divisor
-    hal_outb(PORT_TIMER_DATA, divisor & 0xFF);        // Low byte
-    hal_outb(PORT_TIMER_DATA, (divisor >> 8) & 0xFF); // High byte
+    // Rate generator rather than square wave, so the count read back is the
+    // time left until the next tick
+    pit_program(PIT_MODE_PERIODIC, timer_divisor);
+    oneshot_ticks = 0;
     
     timer_frequency = hz;
 }
 
+// Replace the periodic tick with a single interrupt up to us microseconds
+// away, for a CPU about to idle. On the PIT the one-shot ends on a tick
+// boundary so the tick count stays in phase. Call with interrupts disabled.
+void hal_timer_idle_enter(uint32_t us) {
+    if (clock_source != CLOCK_PIT) {
+        if (us == 0) {
+            return;
+        }
+        uint32_t now = hal_timer_get_us();
+        event_us = now + (us < IDLE_MAX_US ? us : IDLE_MAX_US);
+        event_pending = true;
+        tick_stopped = true;
+        clock_arm(now);
+        return;
+    }
+    
+    uint32_t ticks = us ? (us - 1) / tick_us + 1 : 0;
+    if (oneshot_ticks || ticks < 2) {
+        return;
+    }
+    // A tick already latched would be taken as the end of the whole one-shot
+    if (hal_pic_irq_pending(TIMER_IRQ)) {
+        return;
+    }
+    // The counter is 16 bits: about 55ms whatever the tick rate
+    uint32_t first = pit_read_count();
+    uint32_t max = 1 + (PIT_MAX_COUNT - first) / timer_divisor;
+    if (ticks > max) {
+        ticks = max;
+    }
+    if (ticks < 2) {
+        return;
+    }
+    pit_program(PIT_MODE_ONESHOT, first + (ticks - 1) * timer_divisor);
+    oneshot_ticks = ticks;
+}
+
+// After an early wakeup, count the ticks that have passed and stop the
+// one-shot at the next tick boundary; its interrupt restores the periodic tick.
+// Call with interrupts disabled.
+void hal_timer_idle_exit(void) {
+    if (clock_source != CLOCK_PIT) {
+        if (tick_stopped) {
+            uint32_t now = hal_timer_get_us();
+            tick_stopped = false;
+            clock_advance(now);
+            clock_arm(now);
+        }
+        return;
+    }
+    if (oneshot_ticks <= 1) {
+        return;
+    }
+    uint32_t remaining = pit_read_count();
+    if (hal_pic_irq_pending(TIMER_IRQ)) {
+        // Already expired; the interrupt handler accounts for it
+        return;
+    }
+    // Boundaries still ahead sit at remaining = 0, divisor, 2 * divisor, ...
+    uint32_t ahead = remaining / timer_divisor;
+    if (ahead > oneshot_ticks - 1) {
+        ahead = oneshot_ticks - 1;
+    }
+    uint32_t next = remaining - ahead * timer_divisor;
+    timer_ticks += oneshot_ticks - 1 - ahead;
+    pit_program(PIT_MODE_ONESHOT, next ? next : 1);
+    oneshot_ticks = 1;
+}
+
 // Get current tick count
 uint32_t hal_timer_get_ticks(void) {
     return timer_ticks;
 }
 
+// Microseconds since boot, wrapping every 71 minutes. Tick granularity on the PIT.
+uint32_t hal_timer_get_us(void) {
+    if (clock_source == CLOCK_PIT) {
+        return timer_ticks * tick_us;
+    }
+    uint64_t cycles = hal_cpu_get_cycles() - tsc_base;
+    return (uint32_t)((cycles * tsc_to_us) >> 32);
+}
+
+// Ask for a timer interrupt at clock time deadline_us; the PIT tick only comes
+// on tick boundaries. Call with interrupts disabled.
+void hal_timer_set_event(uint32_t deadline_us) {
+    if (clock_source == CLOCK_PIT) {
+        return;
+    }
+    event_us = deadline_us;
+    event_pending = true;
+    clock_arm(hal_timer_get_us());
+}
+
+// Name of the clock event backend in use
+const char* hal_timer_get_source(void) {
+    if (clock_source == CLOCK_TSC_DEADLINE) {
+        return "local APIC, TSC deadline";
+    }
+    return clock_source == CLOCK_APIC ? "local APIC" : "PIT";
+}
+
 // Busy-wait delay (not recommended, use sleep instead)
 void hal_timer_delay_ms(uint32_t ms) {
     uint32_t start_ticks = timer_ticks;
@@ -64,7 +219,24 @@ void hal_timer_disable_irq(void) {
 
 // Timer interrupt handler (called from interrupt handler)
 void hal_timer_interrupt_handler(void) {
-    timer_ticks++;
+    if (clock_source != CLOCK_PIT) {
+        uint32_t now = hal_timer_get_us();
+        clock_advance(now);
+        if (event_pending && (int32_t)(now - event_us) >= 0) {
+            event_pending = false;
+        }
+        // Like the PIT one-shot, this ends an idle stretch; the tick resumes
+        tick_stopped = false;
+        armed = false;
+        clock_arm(now);
+    } else if (oneshot_ticks) {
+        // The one-shot stood in for several ticks; go back to periodic
+        timer_ticks += oneshot_ticks;
+        oneshot_ticks = 0;
+        pit_program(PIT_MODE_PERIODIC, timer_divisor);
+    } else {
+        timer_ticks++;
+    }
     
     // Call scheduler (this will be implemented in kernel)
     extern void scheduler_tick(void);
@@ -99,3 +271,87 @@ uint32_t hal_timer_get_ms(void) {
 uint32_t hal_timer_get_seconds(void) {
     return timer_ticks / timer_frequency;
 }
+
+// Load channel 0 with a mode and a starting count
+static void pit_program(uint8_t mode, uint32_t count) {
+    hal_outb(PORT_TIMER_CMD, mode);
+    hal_outb(PORT_TIMER_DATA, count & 0xFF);        // Low byte
+    hal_outb(PORT_TIMER_DATA, (count >> 8) & 0xFF); // High byte
+}
+
+// Current channel 0 count
+static uint32_t pit_read_count(void) {
+    hal_outb(PORT_TIMER_CMD, PIT_LATCH);
+    uint32_t low = hal_inb(PORT_TIMER_DATA);
+    uint32_t high = hal_inb(PORT_TIMER_DATA);
+    return (high << 8) | low;
+}
+
+// 64 by 32 bit division with one divl; the quotient must fit in 32 bits
+static uint32_t div64_32(uint64_t dividend, uint32_t divisor) {
+    uint32_t quotient, remainder;
+    __asm__("divl %4"
+            : "=a"(quotient), "=d"(remainder)
+            : "a"((uint32_t)dividend), "d"((uint32_t)(dividend >> 32)), "rm"(divisor));
+    return quotient;
+}
+
+// Time the TSC and the local APIC timer against the PIT; false if either is unusable
+static bool clock_calibrate(void) {
+    hal_apic_timer_oneshot(0xFFFFFFFF);
+    pit_program(PIT_MODE_ONESHOT, PIT_MAX_COUNT);
+    uint32_t start = pit_read_count();
+    uint64_t tsc_start = hal_cpu_get_cycles();
+    uint32_t apic_start = hal_apic_timer_current();
+    
+    uint32_t elapsed;
+    do {
+        elapsed = start - pit_read_count();
+    } while (elapsed < CALIBRATE_PIT_COUNT);
+    
+    uint32_t cycles = (uint32_t)(hal_cpu_get_cycles() - tsc_start);
+    uint32_t counts = apic_start - hal_apic_timer_current();
+    hal_apic_timer_oneshot(0);
+    
+    uint32_t window_us = elapsed * 1000 / (PIT_FREQUENCY / 1000);
+    if (cycles <= window_us || counts == 0) {
+        return false;
+    }
+    tsc_to_us = div64_32((uint64_t)window_us << 32, cycles);
+    us_to_tsc = div64_32((uint64_t)cycles << 12, window_us);
+    us_to_apic = div64_32((uint64_t)counts << 12, window_us);
+    return us_to_apic != 0;
+}
+
+// Count the ticks that have come due by clock time now
+static void clock_advance(uint32_t now) {
+    int32_t late = (int32_t)(now - next_tick_us);
+    if (late >= 0) {
+        uint32_t passed = (uint32_t)late / tick_us + 1;
+        timer_ticks += passed;
+        next_tick_us += passed * tick_us;
+    }
+}
+
+// Program the local APIC for the next tick or the pending event, whichever
+// is earlier; only the event while the tick is stopped
+static void clock_arm(uint32_t now) {
+    uint32_t target = next_tick_us;
+    if (event_pending && (tick_stopped || (int32_t)(event_us - target) < 0)) {
+        target = event_us;
+    }
+    if (armed && target == armed_us) {
+        return;
+    }
+    
+    int32_t delta = (int32_t)(target - now);
+    uint32_t us = delta > 0 ? (uint32_t)delta : 1;
+    if (clock_source == CLOCK_TSC_DEADLINE) {
+        hal_apic_timer_deadline(hal_cpu_get_cycles() + (((uint64_t)us * us_to_tsc) >> 12));
+    } else {
+        uint64_t count = ((uint64_t)us * us_to_apic) >> 12;
+        hal_apic_timer_oneshot(count == 0 ? 1 : count > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)count);
+    }
+    armed_us = target;
+    armed = true;
+}
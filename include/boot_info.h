@@ -0,0 +1,33 @@
+#ifndef BOOT_INFO_H
+#define BOOT_INFO_H
+
+#include <stdint.h>
+
+// Boot information left by stage2 at a fixed physical address.
+// Layout is shared with boot/stage2_stub.asm, which fills it in real mode.
+#define BOOT_INFO_ADDR      0x8000
+#define BOOT_INFO_MAGIC     0x464E4942  // "BINF"
+#define BOOT_E820_MAX       32
+
+// E820 range types
+#define E820_USABLE         1
+#define E820_RESERVED       2
+#define E820_ACPI_RECLAIM   3
+#define E820_ACPI_NVS       4
+#define E820_BAD            5
+
+// One BIOS INT 15h/E820 entry
+typedef struct {
+    uint64_t base;             // Physical start
+    uint64_t length;           // Length in bytes
+    uint32_t type;             // E820_* range type
+    uint32_t acpi;             // ACPI 3.0 extended attributes
+} __attribute__((packed)) e820_entry_t;
+
+typedef struct {
+    uint32_t magic;            // BOOT_INFO_MAGIC when the map is valid
+    uint32_t e820_count;       // Entries in e820
+    e820_entry_t e820[BOOT_E820_MAX];
+} __attribute__((packed)) boot_info_t;
+
+#endif // BOOT_INFO_H
@@ -2,6 +2,20 @@
 #define HAL_H
 
 #include <stdint.h>
+#include "types.h"
+
+// CPU feature bits (hal_cpu_get_features)
+#define CPU_FEAT_FPU    0x00000001
+#define CPU_FEAT_MMX    0x00000002
+#define CPU_FEAT_SSE    0x00000004
+#define CPU_FEAT_SSE2   0x00000008
+#define CPU_FEAT_APIC   0x00000010
+#define CPU_FEAT_TSC    0x00000020
+#define CPU_FEAT_PGE    0x00000040
+#define CPU_FEAT_PSE    0x00000080
+#define CPU_FEAT_PAE    0x00000100
+#define CPU_FEAT_NX     0x00000200
+#define CPU_FEAT_TSC_DEADLINE 0x00000400
 
 // CPU Control functions
 void hal_cpu_init(void);
@@ -13,6 +27,16 @@ uint32_t hal_cpu_get_cr0(void);
 uint32_t hal_cpu_get_cr2(void);
 uint32_t hal_cpu_get_cr3(void);
 void hal_cpu_flush_tlb(void);
+void hal_cpu_flush_tlb_global(void);
+void hal_cpu_invlpg(uint32_t addr);
+uint32_t hal_cpu_get_cr4(void);
+void hal_cpu_set_cr4(uint32_t cr4);
+bool hal_cpu_enable_global_pages(void);
+bool hal_cpu_enable_large_pages(void);
+bool hal_cpu_enable_pae(void);
+bool hal_cpu_enable_nx(void);
+uint64_t hal_cpu_read_msr(uint32_t msr);
+void hal_cpu_write_msr(uint32_t msr, uint64_t value);
 uint64_t hal_cpu_get_cycles(void);
 void hal_cpu_enable_interrupts(void);
 void hal_cpu_disable_interrupts(void);
@@ -45,12 +69,29 @@ void hal_timer_set_frequency(uint32_t hz);
 uint32_t hal_timer_get_ticks(void);
 void hal_timer_delay_ms(uint32_t ms);
 void hal_timer_enable_irq(void);
+uint32_t hal_timer_get_frequency(void);
+void hal_timer_idle_enter(uint32_t us);
+void hal_timer_idle_exit(void);
+uint32_t hal_timer_get_us(void);
+void hal_timer_set_event(uint32_t deadline_us);
+const char* hal_timer_get_source(void);
+
+// Local APIC functions
+#define APIC_TIMER_VECTOR    0x30
+#define APIC_SPURIOUS_VECTOR 0xFF
+bool hal_apic_init(void);
+void hal_apic_eoi(void);
+void hal_apic_timer_enable(bool tsc_deadline);
+void hal_apic_timer_oneshot(uint32_t count);
+void hal_apic_timer_deadline(uint64_t tsc);
+uint32_t hal_apic_timer_current(void);
 
 // PIC functions
 void hal_pic_init(void);
 void hal_pic_mask_irq(uint8_t irq);
 void hal_pic_unmask_irq(uint8_t irq);
 void hal_pic_send_eoi(uint8_t irq);
+bool hal_pic_irq_pending(uint8_t irq);
 void hal_pic_remap(uint8_t offset1, uint8_t offset2);
 
 // Interrupt handling
@@ -70,7 +111,17 @@ void hal_interrupt_disable(void);
 
 // CPU registers
 #define CR0_PE 0x01        // Protected mode enable
+#define CR0_WP 0x10000     // Write protect applies to supervisor writes
 #define CR0_PG 0x80000000  // Paging enable
+#define CR4_PSE 0x10       // 4MB pages enable
+#define CR4_PAE 0x20       // Physical address extension
+#define CR4_PGE 0x80       // Global pages enable
+
+// Model specific registers
+#define MSR_APIC_BASE 0x1B
+#define MSR_TSC_DEADLINE 0x6E0
+#define MSR_EFER 0xC0000080
+#define EFER_NXE 0x800     // No-execute enable
 
 // GDT functions
 void hal_gdt_init(void);
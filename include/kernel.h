@@ -6,6 +6,47 @@
 #include "types.h"
 #include "syscall_numbers.h"
 #include "ipc_abi.h"
+#include "memory_abi.h"
+
+// Virtual memory area kinds
+#define VMA_RESERVED 0         // Address space held with no access (guard pages)
+#define VMA_LAZY     1         // Anonymous memory backed page by page on first touch
+#define VMA_MAPPED   2         // Frames installed up front (image, stack, device memory)
+#define VMA_SHARED   3         // Frames of a shared memory object
+
+// Shared memory object; lives while any process has it mapped
+typedef struct shm_object {
+    uint32_t id;               // Handle passed between processes
+    uint32_t owner_pid;        // Creating process
+    uint32_t pages;            // Size in pages
+    uint32_t mappings;         // Regions that map the object
+    uint64_t granted;          // Processes that may map the object (bit per PID slot, cleared when the slot is released)
+    uint32_t* frames;          // One physical frame per page, each holding a reference
+} shm_object_t;
+
+// Virtual memory area, one node of the per-process AVL tree keyed by start
+typedef struct vm_region {
+    uint32_t start;            // First virtual address
+    uint32_t pages;            // Length in pages
+    uint32_t flags;            // PTE flags for the region's pages
+    uint32_t kind;             // VMA_*
+    shm_object_t* object;      // Backing object for VMA_SHARED
+    struct vm_region* left;    // Regions below start
+    struct vm_region* right;   // Regions above the end
+    int32_t height;            // Subtree height for rebalancing
+} vm_region_t;
+
+#define USER_HEAP_BASE   0x10000000  // User heap window for SYS_MEMORY_ALLOC
+#define USER_HEAP_END    0x40000000
+#define USER_DEVICE_BASE 0x40000000  // Device window for SYS_MEMORY_MAP
+#define USER_DEVICE_END  0x70000000
+#define USER_STACK_TOP   0x80000000  // User stack sits just below, with a guard page under it
+
+// Scheduler priorities; higher levels run first
+#define PRIORITY_LEVELS  32
+#define PRIORITY_IDLE    0   // Only runs when nothing else is ready
+#define PRIORITY_DEFAULT 5
+#define PRIORITY_DRIVER  8   // Kernel-mode drivers
 
 // Process Control Block
 typedef struct pcb {
@@ -13,7 +54,7 @@ typedef struct pcb {
     uint32_t parent_pid;       // Parent process ID
     uint32_t state;            // Current process state
     uint32_t priority;         // Process priority
-    uint32_t cpu_time;         // Total CPU time used
+    uint32_t cpu_time;         // Total CPU time used, in microseconds
     uint32_t page_directory;   // Page directory physical address
     uint32_t kernel_stack;     // Kernel stack pointer
     uint32_t user_stack;       // User stack pointer
@@ -24,6 +65,18 @@ typedef struct pcb {
     struct pcb* prev;          // Previous process in queue
     uint32_t registers[16];    // Saved registers
     bool is_user;              // Whether this is a user-space process
+    uint32_t region_count;     // Regions in the tree
+    vm_region_t* regions;      // Root of the region tree
+    struct pcb* reap_next;     // Next exited process waiting for the reaper
+    uint32_t resident_pages;   // Pages mapped in the address space
+    uint32_t ipc_bytes;        // Message payload queued for this process
+    uint32_t mem_soft_limit;   // Resident pages before new regions are refused (0 for none)
+    uint32_t mem_hard_limit;   // Resident pages that are never exceeded (0 for none)
+    struct run_array* run_array; // Scheduler array holding a ready process
+    uint32_t time_slice;       // Microseconds left in the current quantum
+    bool sleeping;             // On the scheduler's sleep list
+    uint32_t wake_time;        // Clock time (hal_timer_get_us) a sleeping process is due at
+    uint32_t slice_start;      // Clock time it last got the CPU
 } pcb_t;
 
 // Message structure for IPC
@@ -53,9 +106,27 @@ typedef struct {
 // Memory management
 #define PAGE_SIZE 4096
 #define PAGE_ALIGN(addr) (((addr) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define MEMORY_MAX_ORDER 10    // Largest buddy block: 2^10 pages (4MB)
+
+// memory_alloc_pages_flags flags
+#define ALLOC_ZERO 0x01        // Return cleared pages
+#define ALLOC_DMA  0x02        // Only from the zone below 16MB
+
+// Mapping flag: no instruction fetches (enforced in PAE mode with NX, ignored otherwise)
+#define PAGE_NX 0x400
+
+// Mapping flag: shared memory or device page, kept writable in both processes across a fork
+#define PAGE_SHARED 0x800
+
+// Shared memory limits
+#define SHM_MAX_OBJECTS 32
+#define SHM_MAX_PAGES   512    // 2MB per object
 
 // Process management
 #define MAX_PROCESSES 64
+#define PID_GENERATIONS 256    // Reuses of a process slot before its PIDs repeat
+#define PID_MAX (MAX_PROCESSES * PID_GENERATIONS)
+#define PID_SLOT(pid) ((pid) % MAX_PROCESSES)  // PIDs are generation * MAX_PROCESSES + slot
 #define KERNEL_STACK_SIZE 8192
 #define USER_STACK_SIZE 16384
 
@@ -86,18 +157,67 @@ void scheduler_tick(void);
 void scheduler_yield(void);
 pcb_t* scheduler_get_current(void);
 void scheduler_switch_to(pcb_t* next);
+void scheduler_idle(void);
+uint32_t scheduler_quantum(uint32_t priority);
+bool scheduler_has_ready(void);
+void scheduler_sleep(uint32_t us);
+uint32_t scheduler_next_event(void);
 
 // Memory management functions
 void memory_init(void);
 void* memory_alloc_physical(void);
 void memory_free_physical(void* addr);
-uint32_t memory_create_page_directory(void);
+uint32_t memory_create_page_directory(uint32_t owner_pid);
 void memory_destroy_page_directory(uint32_t page_dir);
+uint32_t memory_release_user_tables(uint32_t page_dir, uint32_t first, uint32_t count);
 void memory_map_page(uint32_t page_dir, uint32_t virt_addr, uint32_t phys_addr, uint32_t flags);
 void memory_unmap_page(uint32_t page_dir, uint32_t virt_addr);
+void memory_map_range(uint32_t page_dir, uint32_t virt_addr, uint32_t phys_addr, uint32_t count, uint32_t flags);
+void memory_unmap_range(uint32_t page_dir, uint32_t virt_addr, uint32_t count);
+void memory_get_tlb_stats(uint32_t* full_flushes, uint32_t* invlpgs, uint32_t* flushes_avoided);
+uint32_t memory_get_pte(uint32_t page_dir, uint32_t virt_addr);
+bool memory_pae_enabled(void);
+uint32_t memory_clone_user_pages(uint32_t src_dir, uint32_t dst_dir);
+bool memory_resolve_cow(uint32_t page_dir, uint32_t virt_addr, uint32_t owner_pid);
+void memory_page_get(uint32_t phys_addr);
+void memory_page_put(uint32_t phys_addr);
+uint32_t memory_page_refcount(uint32_t phys_addr);
+bool memory_is_device(uint32_t phys_addr);
+void memory_tag_pages(void* addr, uint32_t count, uint32_t type, uint32_t owner_pid);
+void memory_get_type_stats(uint32_t* pages_by_type);
+uint32_t memory_get_process_pages(uint32_t pid);
+uint32_t memory_get_process_table_pages(uint32_t pid);
+void memory_release_owner(uint32_t pid);
+void memory_get_process_stats(pcb_t* process, memory_stats_t* stats);
+
+// Virtual memory functions
+void vmm_init(void);
+uint32_t vmm_alloc_lazy(pcb_t* process, uint32_t size);
+status_t vmm_alloc_fixed(pcb_t* process, uint32_t virt_addr, uint32_t pages, uint32_t flags);
+status_t vmm_map_fixed(pcb_t* process, uint32_t virt_addr, uint32_t phys_addr, uint32_t pages, uint32_t flags);
+status_t vmm_map_device(pcb_t* process, uint32_t virt_addr, uint32_t phys_addr, uint32_t flags);
+status_t vmm_reserve(pcb_t* process, uint32_t virt_addr, uint32_t pages);
+status_t vmm_clone(pcb_t* parent, pcb_t* child);
+uint32_t vmm_map_shared(pcb_t* process, shm_object_t* object);
+status_t vmm_free(pcb_t* process, uint32_t addr);
+void vmm_destroy(pcb_t* process);
+bool vmm_destroy_step(pcb_t* process);
+bool vmm_handle_fault(pcb_t* process, uint32_t fault_addr, uint32_t err_code);
+void vmm_get_stats(uint32_t* faults_resolved, uint32_t* faults_rejected);
+status_t vmm_set_limits(pcb_t* caller, pcb_t* target, uint32_t soft_pages, uint32_t hard_pages);
+status_t vmm_copy_to_user(pcb_t* process, uint32_t dest, const void* src, uint32_t size);
 void memory_map_kernel(uint32_t page_dir);
+uint32_t memory_map_mmio(uint32_t phys_addr);
 extern uint32_t kernel_page_dir;
 
+// Shared memory functions
+void shm_init(void);
+uint32_t shm_create(pcb_t* process, uint32_t size, uint32_t* id);
+uint32_t shm_map(pcb_t* caller, uint32_t id, uint32_t target_pid);
+void shm_get(shm_object_t* object);
+void shm_put(shm_object_t* object);
+void shm_revoke(uint32_t pid);
+
 // IPC functions
 void ipc_init(void);
 status_t ipc_send(uint32_t receiver_pid, ipc_abi_message_t* user_msg);
@@ -115,22 +235,46 @@ void capability_init(void);
 capability_t* capability_create(uint32_t owner_pid, uint32_t cap_type, uint32_t permissions);
 status_t capability_check(uint32_t pid, uint32_t cap_type, uint32_t permissions);
 void capability_destroy(capability_t* cap);
+void capability_cleanup_expired(void);
+uint32_t capability_next_expiration(void);
 
 // Process management functions
 pcb_t* process_create(uint32_t parent_pid);
 pcb_t* process_create_kernel(void);
+pcb_t* process_clone(pcb_t* parent, const void* trap_frame);
+void process_destroy(pcb_t* process);
 void process_exit(pcb_t* process, uint32_t exit_code);
 status_t process_kill(uint32_t pid);
+status_t process_wait(pcb_t* parent, uint32_t pid, uint32_t* exit_code);
 pcb_t* process_find(uint32_t pid);
+pcb_t* process_at_slot(uint32_t slot);
+void process_reaper_init(void);
 
 // Scheduler functions (forward declarations)
-pcb_t* scheduler_find_process(uint32_t pid);
 void scheduler_block_current(void);
 void scheduler_unblock_process(pcb_t* process);
 
 // Memory management functions (forward declarations)
 void* memory_alloc_pages(uint32_t count);
+void* memory_alloc_pages_flags(uint32_t count, uint32_t flags);
+uint32_t memory_zero_pool_refill(uint32_t max);
+void memory_get_zero_stats(uint32_t* pool_pages, uint32_t* hits, uint32_t* misses);
+void* memory_alloc_dma(uint32_t count);
 void memory_free_pages(void* addr, uint32_t count);
+void memory_get_zone_stats(uint32_t zone, memory_zone_stats_t* stats);
+void memory_get_stats(uint32_t* total, uint32_t* used, uint32_t* free_blocks);
+
+// Slab allocator functions
+typedef struct kmem_cache kmem_cache_t;
+void slab_init(void);
+kmem_cache_t* kmem_cache_create(const char* name, uint32_t size, void (*ctor)(void*));
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+void kmem_cache_set_type(kmem_cache_t* cache, uint32_t type);
+void kmem_cache_get_stats(kmem_cache_t* cache, uint32_t* active, uint32_t* total, uint32_t* slabs);
+void slab_get_stats(uint32_t* slabs, uint32_t* active_bytes, uint32_t* total_bytes);
+void* kmalloc(uint32_t size);
+void kfree(void* ptr);
 
 // Capability functions (forward declarations)
 status_t capability_grant(uint32_t pid, uint32_t cap_type, uint32_t permissions, uint32_t resource_id);
@@ -148,6 +292,14 @@ void timer_interrupt_handler(void);
 void keyboard_interrupt_handler(void);
 void syscall_dispatch(void* frame);
 
+// String functions
+void string_init(void);
+void* memcpy(void* dest, const void* src, uint32_t n);
+void* memset(void* s, int c, uint32_t n);
+
+// Boot-time benchmarks (make BENCH=1)
+void bench_run_all(void);
+
 // Debug functions
 void kernel_panic(const char* message);
 void kernel_print(const char* str);
@@ -0,0 +1,47 @@
+#ifndef MEMORY_ABI_H
+#define MEMORY_ABI_H
+
+#include <stdint.h>
+
+// Frame types for memory accounting (memory_tag_pages)
+#define MEM_TYPE_KERNEL     0  // Untagged kernel allocations
+#define MEM_TYPE_PAGE_TABLE 1  // Page directories and tables
+#define MEM_TYPE_STACK      2  // Kernel and user stacks
+#define MEM_TYPE_IPC        3  // IPC message slabs
+#define MEM_TYPE_USER       4  // Anonymous user pages
+#define MEM_TYPE_CAP        5  // Capability slabs
+#define MEM_TYPE_SLAB       6  // Other slab caches and kmalloc
+#define MEM_TYPE_SHM        7  // Shared memory objects
+#define MEM_TYPE_COUNT      8
+
+// Physical memory zones
+#define MEM_ZONE_DMA        0  // Below 16MB, reachable by ISA DMA and legacy devices
+#define MEM_ZONE_NORMAL     1  // Everything above
+#define MEM_ZONE_COUNT      2
+
+// One zone's free pages against its watermarks
+typedef struct {
+    uint32_t present_pages;    // Pages the zone hands out
+    uint32_t free_pages;       // Pages in its free lists
+    uint32_t lowest_free;      // Fewest free pages seen since boot
+    uint32_t watermark_min;    // Below this the zone is reported as short
+    uint32_t watermark_low;    // DMA zone: generic allocations stop here
+    uint32_t watermark_high;   // Pre-zeroing only takes pages above this
+} memory_zone_stats_t;
+
+// SYS_MEMORY_STATS result: system totals plus one process, filled in one copy
+typedef struct {
+    uint32_t total_pages;                   // Physical pages managed by the kernel
+    uint32_t used_pages;                    // Pages allocated
+    uint32_t pages_by_type[MEM_TYPE_COUNT]; // Allocated pages per MEM_TYPE_*
+    memory_zone_stats_t zones[MEM_ZONE_COUNT]; // Per MEM_ZONE_*
+    uint32_t pid;                           // Process the fields below describe
+    uint32_t resident_pages;                // Pages mapped in its address space
+    uint32_t page_table_pages;              // Its page directory and tables
+    uint32_t ipc_bytes;                     // Message payload queued for it
+    uint32_t regions;                       // Regions in its address space
+    uint32_t soft_limit;                    // Quotas in resident pages, 0 for none
+    uint32_t hard_limit;
+} memory_stats_t;
+
+#endif // MEMORY_ABI_H
@@ -0,0 +1,52 @@
+#ifndef STRING_OPS_H
+#define STRING_OPS_H
+
+#include <stdint.h>
+
+// Copy and fill on the x86 string instructions, shared by stage2, the kernel
+// and user space. Bytes are moved until the destination is dword aligned, then
+// the body goes with rep movsd/stosd and the tail bytewise. The direction flag
+// is clear, as the ABI requires.
+
+#define STRING_SMALL 16   // Shorter runs use a single rep movsb/stosb
+
+static inline void string_copy(void* dest, const void* src, uint32_t n) {
+    if (n < STRING_SMALL) {
+        __asm__ volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+        return;
+    }
+    uint32_t head = (0U - (uint32_t)dest) & 3;
+    uint32_t words = (n - head) >> 2;
+    uint32_t tail = (n - head) & 3;
+    __asm__ volatile(
+        "rep movsb\n"
+        "mov %3, %%ecx\n"
+        "rep movsl\n"
+        "mov %4, %%ecx\n"
+        "rep movsb\n"
+        : "+D"(dest), "+S"(src), "+c"(head)
+        : "r"(words), "r"(tail)
+        : "memory");
+}
+
+static inline void string_fill(void* dest, uint8_t value, uint32_t n) {
+    uint32_t pattern = value * 0x01010101U;
+    if (n < STRING_SMALL) {
+        __asm__ volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(pattern) : "memory");
+        return;
+    }
+    uint32_t head = (0U - (uint32_t)dest) & 3;
+    uint32_t words = (n - head) >> 2;
+    uint32_t tail = (n - head) & 3;
+    __asm__ volatile(
+        "rep stosb\n"
+        "mov %3, %%ecx\n"
+        "rep stosl\n"
+        "mov %4, %%ecx\n"
+        "rep stosb\n"
+        : "+D"(dest), "+c"(head)
+        : "a"(pattern), "r"(words), "r"(tail)
+        : "memory");
+}
+
+#endif // STRING_OPS_H
@@ -6,9 +6,16 @@
 #define SYS_PROCESS_EXIT      0x02
 #define SYS_PROCESS_YIELD     0x03
 #define SYS_PROCESS_KILL      0x04
+#define SYS_PROCESS_WAIT      0x05
+#define SYS_PROCESS_SLEEP     0x06
 #define SYS_MEMORY_ALLOC      0x10
 #define SYS_MEMORY_FREE       0x11
 #define SYS_MEMORY_MAP        0x12
+#define SYS_SHM_CREATE        0x13
+#define SYS_SHM_MAP           0x14
+#define SYS_SHM_UNMAP         0x15
+#define SYS_MEMORY_STATS      0x16
+#define SYS_MEMORY_LIMIT      0x17
 #define SYS_IPC_SEND          0x20
 #define SYS_IPC_RECEIVE       0x21
 #define SYS_IPC_REGISTER      0x22
@@ -17,4 +24,7 @@
 #define SYS_SYSTEM_SHUTDOWN   0x40
 #define SYS_DEBUG_PRINT       0x41
 
+// SYS_PROCESS_CREATE flags (ebx)
+#define PROCESS_CREATE_CLONE  0x01  // Fork the caller copy-on-write; the child sees 0
+
 #endif // SYSCALL_NUMBERS_H
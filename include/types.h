@@ -56,7 +56,8 @@ typedef enum {
     PROCESS_READY,
     PROCESS_RUNNING,
     PROCESS_BLOCKED,
-    PROCESS_TERMINATED
+    PROCESS_TERMINATED,
+    PROCESS_ZOMBIE
 } process_state_t;
 
 // Capability types
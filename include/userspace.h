@@ -6,6 +6,7 @@
 #include <stddef.h>
 #include "syscall_numbers.h"
 #include "ipc_abi.h"
+#include "memory_abi.h"
 #include "types.h"
 
 // System call interface
@@ -24,6 +25,11 @@ static inline uint32_t process_create(void) {
     return syscall(SYS_PROCESS_CREATE, 0, 0, 0);
 }
 
+// Fork the caller; returns the child's PID in the parent and 0 in the child
+static inline uint32_t process_clone(void) {
+    return syscall(SYS_PROCESS_CREATE, PROCESS_CREATE_CLONE, 0, 0);
+}
+
 static inline void process_exit(uint32_t exit_code) {
     syscall(SYS_PROCESS_EXIT, exit_code, 0, 0);
 }
@@ -36,12 +42,23 @@ static inline uint32_t process_kill(uint32_t pid) {
     return syscall(SYS_PROCESS_KILL, pid, 0, 0);
 }
 
+// Wait for a child (0 for any) to exit; returns its PID and stores its exit code
+static inline uint32_t process_wait(uint32_t pid, uint32_t* exit_code) {
+    return syscall(SYS_PROCESS_WAIT, pid, (uint32_t)exit_code, 0);
+}
+
+// Block for at least us microseconds
+static inline void process_sleep(uint32_t us) {
+    syscall(SYS_PROCESS_SLEEP, us, 0, 0);
+}
+
 // Memory management
-static inline void* memory_alloc(uint32_t size) {
-    return (void*)syscall(SYS_MEMORY_ALLOC, size, 0, 0);
+// Raw kernel regions; returns the address, or a negative status as int32_t
+static inline uint32_t memory_region_alloc(uint32_t size) {
+    return syscall(SYS_MEMORY_ALLOC, size, 0, 0);
 }
 
-static inline void memory_free(void* ptr) {
+static inline void memory_region_free(void* ptr) {
     syscall(SYS_MEMORY_FREE, (uint32_t)ptr, 0, 0);
 }
 
@@ -49,6 +66,30 @@ static inline uint32_t memory_map(uint32_t virt_addr, uint32_t phys_addr, uint32
     return syscall(SYS_MEMORY_MAP, virt_addr, phys_addr, flags);
 }
 
+// System and per-process memory counters for pid (0 for the caller)
+static inline uint32_t memory_stats(uint32_t pid, memory_stats_t* stats) {
+    return syscall(SYS_MEMORY_STATS, pid, (uint32_t)stats, 0);
+}
+
+// Resident page quotas for pid (0 for the caller); 0 means no limit
+static inline uint32_t memory_set_limit(uint32_t pid, uint32_t soft_pages, uint32_t hard_pages) {
+    return syscall(SYS_MEMORY_LIMIT, pid, soft_pages, hard_pages);
+}
+
+// Shared memory; addresses are returned, or a negative status as int32_t
+static inline uint32_t shm_create(uint32_t size, uint32_t* handle) {
+    return syscall(SYS_SHM_CREATE, size, (uint32_t)handle, 0);
+}
+
+// Map a shared object into pid (0 for the caller); returns the address in that process
+static inline uint32_t shm_map(uint32_t handle, uint32_t pid) {
+    return syscall(SYS_SHM_MAP, handle, pid, 0);
+}
+
+static inline uint32_t shm_unmap(void* addr) {
+    return syscall(SYS_SHM_UNMAP, (uint32_t)addr, 0, 0);
+}
+
 // IPC
 static inline uint32_t ipc_send(uint32_t receiver_pid, ipc_abi_message_t* msg) {
     return syscall(SYS_IPC_SEND, receiver_pid, (uint32_t)msg, 0);
@@ -102,6 +143,10 @@ int strcmp(const char* str1, const char* str2);
 void* memset(void* ptr, int value, uint32_t size);
 void* memcpy(void* dest, const void* src, uint32_t size);
 
+// Heap allocator
+void* memory_alloc(uint32_t size);
+void memory_free(void* ptr);
+
 // Print functions
 void print(const char* str);
 void print_hex(uint32_t value);
@@ -111,6 +156,7 @@ void println(const char* str);
 uint32_t get_pid(void);
 uint32_t get_parent_pid(void);
 void sleep(uint32_t ms);
+void usleep(uint32_t us);
 
 // Driver utilities
 void driver_print(const char* str);
@@ -0,0 +1,249 @@
+// Kernel Benchmarks
+// Boot-time microbenchmarks, built in with `make BENCH=1`
+
+#include "kernel.h"
+#include "hal.h"
+#include "string_ops.h"
+#include <stddef.h>
+
+#ifdef KERNEL_BENCH
+
+#define BENCH_ITERATIONS 1000
+#define BENCH_COPY_PAGES   256   // 1MB buffers for the copy benchmarks
+#define BENCH_FILL_PERCENT 95    // How full the frame stress benchmark runs memory
+#define BENCH_COPY_VOLUME  (4 * 1024 * 1024)  // Bytes moved per size and method
+
+static const uint32_t bench_copy_sizes[] = { 8, 64, 512, 4096, 65536, BENCH_COPY_PAGES * PAGE_SIZE };
+
+void process_setup_stack(pcb_t* process, uint32_t entry_point);
+bool process_reset_table(void);
+
+// Print a per-iteration cycle count
+static void bench_report(const char* name, uint32_t cycles) {
+    kernel_print("[bench] ");
+    kernel_print(name);
+    kernel_print(": ");
+    kernel_print_hex(cycles);
+    kernel_print(" cycles/iter\r\n");
+}
+
+// Alternate between two address spaces and make a null syscall in each,
+// so every round trip has to refill the TLB for the kernel entry path
+static uint32_t bench_syscall_round_trips(uint32_t dir_a, uint32_t dir_b) {
+    uint32_t start = (uint32_t)hal_cpu_get_cycles();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        uint32_t result;
+        hal_cpu_set_cr3((i & 1) ? dir_a : dir_b);
+        __asm__ volatile("int $0x80"
+                         : "=a"(result)
+                         : "a"(SYS_PROCESS_YIELD), "b"(0), "c"(0), "d"(0)
+                         : "memory");
+        (void)result;
+    }
+    return ((uint32_t)hal_cpu_get_cycles() - start) / BENCH_ITERATIONS;
+}
+
+// Syscall round trips across CR3 switches, with and without global kernel pages
+static void bench_tlb_syscall(void) {
+    uint32_t dir_a = memory_create_page_directory(0);
+    uint32_t dir_b = memory_create_page_directory(0);
+    if (!dir_a || !dir_b) {
+        kernel_print("[bench] tlb: out of memory\r\n");
+        return;
+    }
+    memory_map_kernel(dir_a);
+    memory_map_kernel(dir_b);
+
+    uint32_t saved_cr3 = hal_cpu_get_cr3();
+    uint32_t cr4 = hal_cpu_get_cr4();
+
+    hal_cpu_set_cr4(cr4 & ~CR4_PGE);
+    bench_report("syscall+cr3, no global pages", bench_syscall_round_trips(dir_a, dir_b));
+
+    if (cr4 & CR4_PGE) {
+        hal_cpu_set_cr4(cr4);
+        bench_report("syscall+cr3, global pages", bench_syscall_round_trips(dir_a, dir_b));
+    } else {
+        kernel_print("[bench] PGE not supported\r\n");
+    }
+
+    hal_cpu_set_cr3(saved_cr3);
+    memory_destroy_page_directory(dir_a);
+    memory_destroy_page_directory(dir_b);
+}
+
+// Create and tear down a user process; returns the cycles taken, or 0 on failure
+static uint32_t bench_spawn_exit_once(void) {
+    uint32_t start = (uint32_t)hal_cpu_get_cycles();
+    pcb_t* process = process_create(0);
+    if (!process) {
+        return 0;
+    }
+    process_setup_stack(process, 0x400000);
+    process_destroy(process);
+    return (uint32_t)hal_cpu_get_cycles() - start;
+}
+
+// Process lifecycle cost: the first one allocates everything, later ones reuse
+// the cached kernel stack and page directory
+static void bench_spawn_exit(void) {
+    uint32_t first = bench_spawn_exit_once();
+    if (!first) {
+        kernel_print("[bench] spawn: out of processes\r\n");
+        return;
+    }
+    bench_report("spawn+exit, empty caches", first);
+
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        total += bench_spawn_exit_once();
+    }
+    bench_report("spawn+exit, recycled", total / BENCH_ITERATIONS);
+
+    // Services still start at PID 1
+    process_reset_table();
+}
+
+// The old byte loops, kept from being turned back into memcpy/memset calls
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void bench_copy_bytes(uint8_t* dest, const uint8_t* src, uint32_t n) {
+    while (n--) {
+        *dest++ = *src++;
+    }
+}
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void bench_fill_bytes(uint8_t* dest, uint8_t value, uint32_t n) {
+    while (n--) {
+        *dest++ = value;
+    }
+}
+
+// Print one size's cycle counts for the byte loop, rep string and boot-selected paths
+static void bench_report_size(const char* name, uint32_t size, uint32_t bytes, uint32_t rep, uint32_t selected) {
+    kernel_print("[bench] ");
+    kernel_print(name);
+    kernel_print(" ");
+    kernel_print_hex(size);
+    kernel_print(": bytes ");
+    kernel_print_hex(bytes);
+    kernel_print(", rep ");
+    kernel_print_hex(rep);
+    kernel_print(", selected ");
+    kernel_print_hex(selected);
+    kernel_print(" cycles/iter\r\n");
+}
+
+// memcpy/memset from 8 bytes to 1MB: byte loop, rep movsd/stosd, and what
+// string_init picked for this CPU (non-temporal above 256KB with SSE2)
+static void bench_memcpy(void) {
+    uint8_t* src = (uint8_t*)memory_alloc_pages(BENCH_COPY_PAGES);
+    uint8_t* dest = (uint8_t*)memory_alloc_pages(BENCH_COPY_PAGES);
+    if (!src || !dest) {
+        kernel_print("[bench] memcpy: out of memory\r\n");
+        if (src) memory_free_pages(src, BENCH_COPY_PAGES);
+        if (dest) memory_free_pages(dest, BENCH_COPY_PAGES);
+        return;
+    }
+
+    for (uint32_t n = 0; n < sizeof(bench_copy_sizes) / sizeof(bench_copy_sizes[0]); n++) {
+        uint32_t size = bench_copy_sizes[n];
+        uint32_t rounds = BENCH_COPY_VOLUME / size;
+        uint32_t cycles[6];
+        uint32_t start;
+
+        start = (uint32_t)hal_cpu_get_cycles();
+        for (uint32_t i = 0; i < rounds; i++) bench_copy_bytes(dest, src, size);
+        cycles[0] = ((uint32_t)hal_cpu_get_cycles() - start) / rounds;
+        start = (uint32_t)hal_cpu_get_cycles();
+        for (uint32_t i = 0; i < rounds; i++) string_copy(dest, src, size);
+        cycles[1] = ((uint32_t)hal_cpu_get_cycles() - start) / rounds;
+        start = (uint32_t)hal_cpu_get_cycles();
+        for (uint32_t i = 0; i < rounds; i++) memcpy(dest, src, size);
+        cycles[2] = ((uint32_t)hal_cpu_get_cycles() - start) / rounds;
+
+        start = (uint32_t)hal_cpu_get_cycles();
+        for (uint32_t i = 0; i < rounds; i++) bench_fill_bytes(dest, (uint8_t)i, size);
+        cycles[3] = ((uint32_t)hal_cpu_get_cycles() - start) / rounds;
+        start = (uint32_t)hal_cpu_get_cycles();
+        for (uint32_t i = 0; i < rounds; i++) string_fill(dest, (uint8_t)i, size);
+        cycles[4] = ((uint32_t)hal_cpu_get_cycles() - start) / rounds;
+        start = (uint32_t)hal_cpu_get_cycles();
+        for (uint32_t i = 0; i < rounds; i++) memset(dest, (uint8_t)i, size);
+        cycles[5] = ((uint32_t)hal_cpu_get_cycles() - start) / rounds;
+
+        bench_report_size("memcpy", size, cycles[0], cycles[1], cycles[2]);
+        bench_report_size("memset", size, cycles[3], cycles[4], cycles[5]);
+    }
+
+    memory_free_pages(src, BENCH_COPY_PAGES);
+    memory_free_pages(dest, BENCH_COPY_PAGES);
+}
+
+// Time one allocate/free pair of count pages
+static uint32_t bench_frame_pairs(uint32_t count) {
+    uint32_t start = (uint32_t)hal_cpu_get_cycles();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        void* pages = memory_alloc_pages(count);
+        if (!pages) {
+            return 0;
+        }
+        memory_free_pages(pages, count);
+    }
+    return ((uint32_t)hal_cpu_get_cycles() - start) / BENCH_ITERATIONS;
+}
+
+// Frame allocator under pressure: fill memory to 95% with single pages, then
+// time allocations while only the last few free blocks remain
+static void bench_frame_alloc(void) {
+    memory_zone_stats_t zone;
+    uint32_t present = 0;
+    uint32_t free = 0;
+    for (uint32_t z = 0; z < MEM_ZONE_COUNT; z++) {
+        memory_get_zone_stats(z, &zone);
+        present += zone.present_pages;
+        free += zone.free_pages;
+    }
+
+    bench_report("frame alloc+free, 1 page, idle", bench_frame_pairs(1));
+
+    // Held pages are chained through their first word
+    uint32_t* held = NULL;
+    uint32_t count = 0;
+    uint32_t target = present / 100 * (100 - BENCH_FILL_PERCENT);
+    uint32_t start = (uint32_t)hal_cpu_get_cycles();
+    while (free > target) {
+        uint32_t* page = (uint32_t*)memory_alloc_pages(1);
+        if (!page) {
+            break;
+        }
+        *page = (uint32_t)held;
+        held = page;
+        count++;
+        free--;
+    }
+    uint32_t cycles = (uint32_t)hal_cpu_get_cycles() - start;
+    if (count) {
+        bench_report("frame alloc, filling to 95%", cycles / count);
+    }
+
+    bench_report("frame alloc+free, 1 page, 95% full", bench_frame_pairs(1));
+    bench_report("frame alloc+free, 8 pages, 95% full", bench_frame_pairs(8));
+
+    while (held) {
+        uint32_t* next = (uint32_t*)*held;
+        memory_free_pages(held, 1);
+        held = next;
+    }
+}
+
+// Run every benchmark (interrupts disabled, before services start)
+void bench_run_all(void) {
+    kernel_print("Running kernel benchmarks...\r\n");
+    bench_tlb_syscall();
+    bench_spawn_exit();
+    bench_frame_alloc();
+    bench_memcpy();
+}
+
+#endif // KERNEL_BENCH
@@ -9,6 +9,8 @@
 static capability_t* capabilities[MAX_PROCESSES * 16];  // 16 capabilities per process max
 static uint32_t capability_count = 0;
 static uint32_t next_cap_id = 1;
+static kmem_cache_t* capability_cache = NULL;
+static uint32_t next_expiry = 0;  // Earliest expiration tick, 0 for none
 
 // Forward declarations
 static capability_t* capability_find_by_id(uint32_t cap_id);
@@ -24,6 +26,9 @@ void capability_init(void) {
     
     capability_count = 0;
     next_cap_id = 1;
+    next_expiry = 0;
+    capability_cache = kmem_cache_create("capability", sizeof(capability_t), NULL);
+    kmem_cache_set_type(capability_cache, MEM_TYPE_CAP);
     
     kernel_print("Capability system initialized\r\n");
 }
@@ -35,7 +40,7 @@ capability_t* capability_create(uint32_t owner_pid, uint32_t cap_type, uint32_t
     }
     
     // Allocate capability structure
-    capability_t* cap = (capability_t*)memory_alloc_pages(1);
+    capability_t* cap = (capability_t*)kmem_cache_alloc(capability_cache);
     if (!cap) {
         return NULL;
     }
@@ -105,7 +110,7 @@ void capability_destroy(capability_t* cap) {
     }
     
     // Free memory
-    memory_free_pages(cap, 1);
+    kmem_cache_free(capability_cache, cap);
 }
 
 // Transfer capability to another process
@@ -230,6 +235,9 @@ status_t capability_set_expiration(capability_t* cap, uint32_t expiration_time)
     }
     
     cap->expiration_time = expiration_time;
+    if (expiration_time && (next_expiry == 0 || expiration_time < next_expiry)) {
+        next_expiry = expiration_time;
+    }
     
     return STATUS_SUCCESS;
 }
@@ -237,6 +245,7 @@ status_t capability_set_expiration(capability_t* cap, uint32_t expiration_time)
 // Clean up expired capabilities
 void capability_cleanup_expired(void) {
     uint32_t current_time = hal_timer_get_ticks();
+    next_expiry = 0;
     
     for (int i = 0; i < MAX_PROCESSES * 16; i++) {
         capability_t* cap = capabilities[i];
@@ -246,10 +255,17 @@ void capability_cleanup_expired(void) {
         
         if (cap->expiration_time > 0 && cap->expiration_time <= current_time) {
             capability_destroy(cap);
+        } else if (cap->expiration_time > 0 && (next_expiry == 0 || cap->expiration_time < next_expiry)) {
+            next_expiry = cap->expiration_time;
         }
     }
 }
 
+// Tick at which the next capability expires, 0 for none; a timer event for the scheduler
+uint32_t capability_next_expiration(void) {
+    return next_expiry;
+}
+
 // Get capability statistics
 void capability_get_stats(uint32_t* total_caps, uint32_t* caps_per_process) {
     if (total_caps) *total_caps = capability_count;
@@ -37,6 +37,8 @@ extern void machine_check_handler(void);
 extern void simd_floating_point_handler(void);
 extern void timer_irq_handler(void);
 extern void keyboard_irq_handler(void);
+extern void apic_timer_handler(void);
+extern void apic_spurious_handler(void);
 extern void syscall_handler_wrapper(void);
 
 // IDT structures
@@ -83,6 +85,8 @@ void interrupt_init(void) {
     
     idt_set_gate(32, (uint32_t)timer_irq_handler, 0x08, 0x8E);
     idt_set_gate(33, (uint32_t)keyboard_irq_handler, 0x08, 0x8E);
+    idt_set_gate(APIC_TIMER_VECTOR, (uint32_t)apic_timer_handler, 0x08, 0x8E);
+    idt_set_gate(APIC_SPURIOUS_VECTOR, (uint32_t)apic_spurious_handler, 0x08, 0x8E);
     
     // Syscall handler (DPL=3)
     idt_set_gate(0x80, (uint32_t)syscall_handler_wrapper, 0x08, 0xEE);
@@ -106,6 +110,11 @@ void interrupt_handler_common(trap_frame_t* frame) {
     if (frame->int_no < 32) {
         pcb_t* current = scheduler_get_current();
         
+        // Demand faults on reserved regions are resolved and the access retried
+        if (frame->int_no == 14 && vmm_handle_fault(current, hal_cpu_get_cr2(), frame->err_code)) {
+            return;
+        }
+        
         kernel_print("\r\nCPU EXCEPTION ");
         kernel_print_hex(frame->int_no);
         kernel_print(" (");
@@ -168,6 +177,9 @@ void interrupt_handler_common(trap_frame_t* frame) {
         kernel_panic("Unhandled CPU exception in kernel");
     } else if (frame->int_no >= 32 && frame->int_no < 48) {
         uint32_t irq = frame->int_no - 32;
+        // Acknowledge first: the timer handler may switch tasks before it returns,
+        // and the next tick or one-shot must still be delivered
+        hal_pic_send_eoi(irq);
         if (irq == 0) {
             extern void timer_interrupt_handler(void);
             timer_interrupt_handler();
@@ -175,7 +187,10 @@ void interrupt_handler_common(trap_frame_t* frame) {
             extern void keyboard_interrupt_handler(void);
             keyboard_interrupt_handler();
         }
-        hal_pic_send_eoi(irq);
+    } else if (frame->int_no == APIC_TIMER_VECTOR) {
+        extern void timer_interrupt_handler(void);
+        hal_apic_eoi();
+        timer_interrupt_handler();
     }
 }
 
@@ -236,6 +251,9 @@ __asm__ (
 "simd_floating_point_handler: push $0; push $19; jmp interrupt_common\n"
 "timer_irq_handler: push $0; push $32; jmp interrupt_common\n"
 "keyboard_irq_handler: push $0; push $33; jmp interrupt_common\n"
+"apic_timer_handler: push $0; push $0x30; jmp interrupt_common\n"
+// Spurious APIC interrupts are not acknowledged
+"apic_spurious_handler: iret\n"
 
 "syscall_handler_wrapper:\n"
     "push $0\n"
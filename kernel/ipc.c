@@ -5,12 +5,13 @@
 #include "hal.h"
 #include <stddef.h>
 
-// External memcpy from kernel main
-extern void* memcpy(void* dest, const void* src, uint32_t n);
 
-// IPC state
+#define IPC_MAX_DATA 256
+
+// IPC state; queues are indexed by process slot
 static ipc_message_t* message_queues[MAX_PROCESSES];
 static uint32_t next_msg_id = 1;
+static kmem_cache_t* ipc_message_cache = NULL;
 static void (*msg_handlers[32])(ipc_message_t*) = {NULL};
 
 // Message queue structure
@@ -26,6 +27,7 @@ static void ipc_add_to_queue(uint32_t pid, ipc_message_t* msg);
 static ipc_message_t* ipc_remove_from_queue(uint32_t pid);
 static ipc_message_t* ipc_find_in_queue(uint32_t pid, uint32_t sender_pid);
 static void ipc_wakeup_receiver(uint32_t pid);
+static void ipc_account(uint32_t pid, int32_t bytes);
 
 // Initialize IPC system
 void ipc_init(void) {
@@ -35,6 +37,8 @@ void ipc_init(void) {
     }
     
     next_msg_id = 1;
+    ipc_message_cache = kmem_cache_create("ipc_message", sizeof(ipc_message_t) + IPC_MAX_DATA, NULL);
+    kmem_cache_set_type(ipc_message_cache, MEM_TYPE_IPC);
     
     // Clear message handlers
     for (int i = 0; i < 32; i++) {
@@ -50,21 +54,18 @@ status_t ipc_send(uint32_t receiver_pid, ipc_abi_message_t* user_msg) {
         return STATUS_INVALID_PARAM;
     }
     
-    pcb_t* receiver = scheduler_find_process(receiver_pid);
+    pcb_t* receiver = process_find(receiver_pid);
     if (!receiver) {
         return STATUS_NOT_FOUND;
     }
     
     // Validate message size
-    if (user_msg->data_size > 256) {
+    if (user_msg->data_size > IPC_MAX_DATA) {
         return STATUS_INVALID_PARAM;
     }
     
-    // Allocate kernel message with proper size
-    size_t msg_size = sizeof(ipc_message_t) + user_msg->data_size;
-    ipc_message_t* kernel_msg = (ipc_message_t*)memory_alloc_pages(
-        (msg_size + PAGE_SIZE - 1) / PAGE_SIZE
-    );
+    // Allocate kernel message (sized for the largest payload)
+    ipc_message_t* kernel_msg = (ipc_message_t*)kmem_cache_alloc(ipc_message_cache);
     
     if (!kernel_msg) {
         return STATUS_OUT_OF_MEMORY;
@@ -125,13 +126,13 @@ status_t ipc_receive(uint32_t sender_pid, ipc_abi_message_t* user_msg, bool bloc
         user_msg->data_size = kernel_msg->data_size;
         
         // Copy message data
-        if (kernel_msg->data_size > 0 && kernel_msg->data_size <= 256) {
+        if (kernel_msg->data_size > 0 && kernel_msg->data_size <= IPC_MAX_DATA) {
             memcpy(user_msg->data, kernel_msg->data, kernel_msg->data_size);
         }
     }
     
     // Free kernel message
-    memory_free_pages(kernel_msg, 1);
+    kmem_cache_free(ipc_message_cache, kernel_msg);
     
     return STATUS_SUCCESS;
 }
@@ -157,8 +158,12 @@ status_t ipc_broadcast(uint32_t msg_type, ipc_abi_message_t* user_msg) {
     
     // Send to all processes
     for (int i = 1; i < MAX_PROCESSES; i++) {  // Skip PID 0 (kernel)
+        pcb_t* process = process_at_slot(i);
+        if (!process) {
+            continue;
+        }
         // Create a copy of the message for each process
-        status_t result = ipc_send(i, user_msg);
+        status_t result = ipc_send(process->pid, user_msg);
         if (result == STATUS_SUCCESS) {
             sent_count++;
         }
@@ -169,11 +174,11 @@ status_t ipc_broadcast(uint32_t msg_type, ipc_abi_message_t* user_msg) {
 
 // Get message queue statistics
 status_t ipc_get_queue_stats(uint32_t pid, uint32_t* count, uint32_t* max_count) {
-    if (pid >= MAX_PROCESSES) {
+    if (pid >= PID_MAX) {
         return STATUS_INVALID_PARAM;
     }
     
-    message_queue_t* queue = (message_queue_t*)message_queues[pid];
+    message_queue_t* queue = (message_queue_t*)message_queues[PID_SLOT(pid)];
     if (!queue) {
         if (count) *count = 0;
         if (max_count) *max_count = 0;
@@ -188,11 +193,11 @@ status_t ipc_get_queue_stats(uint32_t pid, uint32_t* count, uint32_t* max_count)
 
 // Clear message queue
 status_t ipc_clear_queue(uint32_t pid) {
-    if (pid >= MAX_PROCESSES) {
+    if (pid >= PID_MAX) {
         return STATUS_INVALID_PARAM;
     }
     
-    message_queue_t* queue = (message_queue_t*)message_queues[pid];
+    message_queue_t* queue = (message_queue_t*)message_queues[PID_SLOT(pid)];
     if (!queue) {
         return STATUS_SUCCESS;
     }
@@ -201,7 +206,7 @@ status_t ipc_clear_queue(uint32_t pid) {
     ipc_message_t* current = queue->head;
     while (current) {
         ipc_message_t* next = current->next;
-        memory_free_pages(current, 1);
+        kmem_cache_free(ipc_message_cache, current);
         current = next;
     }
     
@@ -210,6 +215,11 @@ status_t ipc_clear_queue(uint32_t pid) {
     queue->tail = NULL;
     queue->count = 0;
     
+    pcb_t* process = process_find(pid);
+    if (process) {
+        process->ipc_bytes = 0;
+    }
+    
     return STATUS_SUCCESS;
 }
 
@@ -220,26 +230,26 @@ static void ipc_add_to_queue(uint32_t pid, ipc_message_t* msg) {
     }
     
     // Create queue if it doesn't exist
-    if (!message_queues[pid]) {
-        message_queues[pid] = (ipc_message_t*)memory_alloc_pages(1);
-        if (!message_queues[pid]) {
+    if (!message_queues[PID_SLOT(pid)]) {
+        message_queues[PID_SLOT(pid)] = (ipc_message_t*)kmalloc(sizeof(message_queue_t));
+        if (!message_queues[PID_SLOT(pid)]) {
             return;
         }
         
         // Initialize queue header
-        message_queue_t* queue = (message_queue_t*)message_queues[pid];
+        message_queue_t* queue = (message_queue_t*)message_queues[PID_SLOT(pid)];
         queue->head = NULL;
         queue->tail = NULL;
         queue->count = 0;
         queue->max_count = 100;  // Maximum 100 messages per process
     }
     
-    message_queue_t* queue = (message_queue_t*)message_queues[pid];
+    message_queue_t* queue = (message_queue_t*)message_queues[PID_SLOT(pid)];
     
     // Check queue limit
     if (queue->count >= queue->max_count) {
-        // Remove oldest message
-        ipc_remove_from_queue(pid);
+        // Drop the oldest message
+        kmem_cache_free(ipc_message_cache, ipc_remove_from_queue(pid));
     }
     
     // Add to end of queue
@@ -254,11 +264,12 @@ static void ipc_add_to_queue(uint32_t pid, ipc_message_t* msg) {
     }
     
     queue->count++;
+    ipc_account(pid, (int32_t)msg->data_size);
 }
 
 // Remove message from queue
 static ipc_message_t* ipc_remove_from_queue(uint32_t pid) {
-    message_queue_t* queue = (message_queue_t*)message_queues[pid];
+    message_queue_t* queue = (message_queue_t*)message_queues[PID_SLOT(pid)];
     if (!queue || !queue->head) {
         return NULL;
     }
@@ -272,13 +283,14 @@ static ipc_message_t* ipc_remove_from_queue(uint32_t pid) {
     
     queue->count--;
     msg->next = NULL;
+    ipc_account(pid, -(int32_t)msg->data_size);
     
     return msg;
 }
 
 // Find message from specific sender
 static ipc_message_t* ipc_find_in_queue(uint32_t pid, uint32_t sender_pid) {
-    message_queue_t* queue = (message_queue_t*)message_queues[pid];
+    message_queue_t* queue = (message_queue_t*)message_queues[PID_SLOT(pid)];
     if (!queue) {
         return NULL;
     }
@@ -301,6 +313,7 @@ static ipc_message_t* ipc_find_in_queue(uint32_t pid, uint32_t sender_pid) {
             
             queue->count--;
             current->next = NULL;
+            ipc_account(pid, -(int32_t)current->data_size);
             return current;
         }
         
@@ -313,9 +326,17 @@ static ipc_message_t* ipc_find_in_queue(uint32_t pid, uint32_t sender_pid) {
 
 // Wake up receiver process
 static void ipc_wakeup_receiver(uint32_t pid) {
-    pcb_t* process = scheduler_find_process(pid);
+    pcb_t* process = process_find(pid);
     if (process && process->state == PROCESS_BLOCKED) {
         scheduler_unblock_process(process);
         process->waiting_for = 0;
     }
 }
+
+// Track the payload bytes queued for a process
+static void ipc_account(uint32_t pid, int32_t bytes) {
+    pcb_t* process = process_find(pid);
+    if (process) {
+        process->ipc_bytes += bytes;
+    }
+}
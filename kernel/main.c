@@ -68,23 +68,6 @@ void kernel_panic(const char* message) {
     }
 }
 
-void* memcpy(void* dest, const void* src, size_t n) {
-    uint8_t* d = (uint8_t*)dest;
-    const uint8_t* s = (const uint8_t*)src;
-    while (n--) {
-        *d++ = *s++;
-    }
-    return dest;
-}
-
-void* memset(void* s, int c, size_t n) {
-    uint8_t* p = (uint8_t*)s;
-    while (n--) {
-        *p++ = (uint8_t)c;
-    }
-    return s;
-}
-
 // Forward declarations
 static void clear_bss(void);
 static void start_system_services(void);
@@ -108,6 +91,7 @@ void kernel_main(void) {
     hal_gdt_init();
     vga_print("GDT initialized", 4);
     hal_cpu_init();
+    string_init();
     vga_print("CPU initialized", 5);
     hal_io_init();
     vga_print("I/O initialized", 5);
@@ -117,6 +101,8 @@ void kernel_main(void) {
     // Memory
     memory_init();
     vga_print("Memory manager initialized", 7);
+    slab_init();
+    vmm_init();
     
     // Process subsystems
     scheduler_init();
@@ -127,6 +113,7 @@ void kernel_main(void) {
     vga_print("IPC initialized", 10);
     capability_init();
     vga_print("Capability system initialized", 11);
+    shm_init();
     
     // Interrupts & syscalls
     syscall_init();
@@ -135,6 +122,13 @@ void kernel_main(void) {
     vga_print("Interrupts initialized", 13);
     hal_timer_init(100);
     vga_print("Timer enabled", 14);
+    kernel_print("Clock events: ");
+    kernel_print(hal_timer_get_source());
+    kernel_print("\r\n");
+    
+#ifdef KERNEL_BENCH
+    bench_run_all();
+#endif
     
     kernel_initialized = true;
     vga_print("Kernel initialization complete!", 15);
@@ -148,7 +142,7 @@ void kernel_main(void) {
     // Enable interrupts
     hal_cpu_enable_interrupts();
     
-    // Idle loop
+    // The first timer tick switches away for good; the idle task takes over from there
     while (1) {
         __asm__ volatile("hlt");
     }
@@ -178,13 +172,15 @@ static void start_service(const char* name, uint32_t phys_addr, bool is_user) {
     }
     
     // Map the binary (assuming 32KB max for now) to virtual 0x400000
-    for (uint32_t i = 0; i < 8; i++) { // 8 pages = 32KB
-        memory_map_page(proc->page_directory, 0x400000 + i * PAGE_SIZE, phys_addr + i * PAGE_SIZE, 0x07);
-    }
+    vmm_map_fixed(proc, 0x400000, phys_addr, 8, 0x07); // 8 pages = 32KB
     
     // Set entry point to standard 0x400000
     process_setup_stack(proc, 0x400000);
     
+    // Drivers go ahead of user programs so requests to them don't queue behind busy loops
+    if (!is_user) {
+        scheduler_set_priority(proc, PRIORITY_DRIVER);
+    }
     scheduler_add_process(proc);
 }
 
@@ -204,5 +200,16 @@ static void start_system_services(void) {
     vga_print("Starting Shell (PID 5)...", 16);
     start_service("Shell", 0x420000, true);
     
+    // Idle task refills the zero page pool when nothing else is runnable
+    pcb_t* idle = process_create_kernel();
+    if (idle) {
+        process_setup_stack(idle, (uint32_t)scheduler_idle);
+        scheduler_set_priority(idle, PRIORITY_IDLE);
+        scheduler_add_process(idle);
+    }
+    
+    // Reaper frees exited processes at low priority
+    process_reaper_init();
+    
     kernel_print("System services started.\r\n");
 }
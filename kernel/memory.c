@@ -3,164 +3,1170 @@
 
 #include "kernel.h"
 #include "hal.h"
+#include "boot_info.h"
 #include <stddef.h>
 
-#define MEMORY_SIZE (16 * 1024 * 1024)  // 16MB for now
-#define PHYS_PAGES (MEMORY_SIZE / PAGE_SIZE)
-#define BITMAP_SIZE (PHYS_PAGES / 32)
+#define LEGACY_MEMORY_SIZE (16 * 1024 * 1024)  // Assumed when stage2 left no E820 map
+#define DIRECT_MAP_LIMIT USER_HEAP_BASE         // Memory the kernel reaches through its identity map
+#define LOW_MEMORY_END 0x100000                 // BIOS, EBDA, video memory
+#define KERNEL_BASE 0x100000
+#define TLB_INVLPG_MAX 32                 // Larger ranges use one full flush instead
+#define PAGE_GLOBAL 0x100                 // PTE global bit (needs CR4.PGE)
+#define PAGE_HW_BITS 0x60                 // Accessed/Dirty, set by the CPU
+#define PDE_LARGE 0x80                    // PDE maps a 4MB page (2MB with PAE; needs CR4.PSE without)
+#define LARGE_PAGE_FLAGS 0x17F            // PDE bits that carry over to split PTEs
+#define PAGE_COW 0x200                    // Software bit: read-only until a write copies the frame
+#define PAE_PDPT_ENTRIES 4                // Page directories behind a PAE CR3
+#define PAE_NX_HIGH 0x80000000            // Bit 63 of a PAE entry, seen from its high half
 
-static uint32_t page_bitmap[BITMAP_SIZE];
+// Programs copied to 4MB by stage2 (see boot/stage2_c.c)
+#define BOOT_MODULES_BASE 0x400000
+#define BOOT_MODULES_SIZE (256 * 1024)
+
+// Pre-zeroed single pages, refilled from the idle task
+#define ZERO_POOL_TARGET 64
+
+// Clean page directories kept for process creation
+#define DIR_CACHE_SIZE 8
+
+// Zone boundary; a multiple of the largest buddy block, so buddies never straddle it
+#define ZONE_DMA_END (16 * 1024 * 1024)
+#define ZONE_WATERMARK_FLOOR 8   // Smallest min watermark for a non-empty zone
+
+// Buddy allocator frame state
+#define FRAME_NONE          0xFFFFFFFF
+#define FRAME_FLAG_FREE     0x01  // Head of a free block (order is valid)
+#define FRAME_FLAG_USED     0x02  // Handed out by memory_alloc_pages
+#define FRAME_FLAG_RESERVED 0x04  // Never handed out
+#define FRAME_FLAG_ZEROED   0x08  // Cleared and parked in the zero pool
+
+typedef struct {
+    uint32_t next;             // Next free block of the same order
+    uint32_t prev;             // Previous free block of the same order
+    uint8_t order;             // Block order while FRAME_FLAG_FREE is set
+    uint8_t flags;             // FRAME_FLAG_*
+    uint8_t type;              // MEM_TYPE_* of an allocated frame
+    uint16_t owner;            // Owning PID, 0 for the kernel
+    uint16_t refcount;         // Mappings holding an allocated frame
+} page_frame_t;
+
+static page_frame_t* frames = NULL;      // Frame database, placed after the kernel image
+static uint32_t phys_pages = 0;          // Frames tracked by the frame database
+static uint32_t detected_pages = 0;      // Physical memory reported by firmware (4GB, 64GB with PAE)
+static uint32_t kernel_pdes = 0;         // Directory entries covering the identity map
+static uint32_t kernel_mmio_pde = 0;     // Directory entry holding kernel device mappings, 0 for none
+static uint32_t ram_start[BOOT_E820_MAX]; // Usable RAM ranges in frames, for memory_is_device
+static uint32_t ram_end[BOOT_E820_MAX];
+static uint32_t ram_ranges = 0;
+
+// Paging geometry, picked at boot. PAE has 64-bit entries, 2MB directory
+// entries, and a PDPT page followed by four page directories.
+static bool pae_enabled = false;
+static bool nx_enabled = false;
+static uint32_t pde_shift = 22;          // Address bits below one directory entry
+static uint32_t table_entries = 1024;    // Entries per page table
+static uint32_t dir_entries = 1024;      // Directory entries per address space
+static uint32_t dir_pages = 1;           // Pages behind one CR3 value
+
+// Each zone has its own buddy free lists and watermarks
+typedef struct {
+    uint32_t free_lists[MEMORY_MAX_ORDER + 1];
+    uint32_t free_block_count[MEMORY_MAX_ORDER + 1];
+    uint32_t order_mask;       // One bit per order whose free list is not empty
+    uint32_t present_pages;    // Pages released to the zone at boot
+    uint32_t free_pages;       // Pages in the free lists
+    uint32_t lowest_free;      // Fewest free pages seen
+    uint32_t watermark_min;
+    uint32_t watermark_low;
+    uint32_t watermark_high;
+    bool short_reported;       // Below min was reported; rearmed above high
+} mem_zone_t;
+
+static mem_zone_t zones[MEM_ZONE_COUNT];
 static uint32_t total_allocated_pages = 0;
+static uint32_t type_pages[MEM_TYPE_COUNT];   // Allocated frames per MEM_TYPE_*
+static uint32_t owner_pages[MAX_PROCESSES];   // Allocated frames per owner slot
+static uint32_t owner_table_pages[MAX_PROCESSES]; // Page table frames per owner slot
+static uint16_t owner_slot_pid[MAX_PROCESSES]; // PID a slot's counters belong to, 0 while unclaimed
+
+// Zero pool, linked through frames[].next
+static uint32_t zero_pool_head = FRAME_NONE;
+static uint32_t zero_pool_count = 0;
+static uint32_t zero_pool_hits = 0;    // ALLOC_ZERO pages served already cleared
+static uint32_t zero_pool_misses = 0;  // ALLOC_ZERO pages cleared on the caller's path
+
+// Recycled page directories: user entries cleared, kernel entries in place
+static uint32_t dir_cache[DIR_CACHE_SIZE];
+static uint32_t dir_cache_count = 0;
+
+// TLB maintenance counters
+static uint32_t tlb_full_flushes = 0;
+static uint32_t tlb_invlpgs = 0;
+static uint32_t tlb_flushes_avoided = 0;
 
 uint32_t kernel_page_dir = 0;
-extern uint32_t __bss_start;
-extern uint32_t __bss_end;
+static uint32_t kernel_page_flags = 0x03;  // Present, RW, Supervisor
+static bool kernel_large_pages = false;
+extern uint32_t __end;
 
 // Forward declarations
-static void bitmap_set(uint32_t page);
-static void bitmap_clear(uint32_t page);
-static bool bitmap_test(uint32_t page);
+static void buddy_list_push(uint32_t frame, uint32_t order);
+static void buddy_list_remove(uint32_t frame, uint32_t order);
+static void buddy_free_block(uint32_t frame, uint32_t order);
+static void buddy_free_range(uint32_t frame, uint32_t count);
+static uint32_t buddy_order_for(uint32_t count);
+static void* buddy_alloc(uint32_t count, uint32_t flags);
+static void* buddy_alloc_zone(mem_zone_t* zone, uint32_t count);
+static void zone_init_watermarks(mem_zone_t* zone);
+static uint32_t zero_pool_take(void);
+static void frame_account(uint32_t frame, uint32_t type, uint32_t owner);
+static void frame_unaccount(uint32_t frame);
+static void memory_scan_e820(const boot_info_t* info);
+static void memory_mark_range(uint64_t start, uint64_t end, uint8_t flags);
+static void memory_build_kernel_map(void);
+static bool memory_is_kernel_table(uint32_t pd_index, uint32_t pde);
+static uint32_t memory_split_large_page(uint32_t dir, uint32_t pd_index);
+static void memory_update_range(uint32_t page_dir, uint32_t virt_addr, uint32_t phys_addr,
+                                uint32_t count, uint32_t flags, bool map);
+
+// Read a page table or directory entry. Only the low half of a PAE entry is
+// returned: frames live below 4GB and PAGE_NX is kept there as well.
+static inline uint32_t pt_get(uint32_t table, uint32_t index) {
+    return pae_enabled ? ((uint32_t*)table)[index * 2] : ((uint32_t*)table)[index];
+}
+
+// Write an entry; in PAE mode PAGE_NX also sets the hardware NX bit
+static inline void pt_set(uint32_t table, uint32_t index, uint32_t entry) {
+    if (pae_enabled) {
+        volatile uint32_t* e = (uint32_t*)table + index * 2;
+        e[1] = (nx_enabled && (entry & PAGE_NX)) ? PAE_NX_HIGH : 0;
+        e[0] = entry;
+    } else {
+        ((uint32_t*)table)[index] = entry;
+    }
+}
+
+// Owner of a directory; its page tables are charged to the same process
+static inline uint32_t dir_owner(uint32_t page_dir) {
+    uint32_t frame = page_dir / PAGE_SIZE;
+    return (frame < phys_pages) ? frames[frame].owner : 0;
+}
+
+static inline mem_zone_t* frame_zone(uint32_t frame) {
+    return &zones[frame < ZONE_DMA_END / PAGE_SIZE ? MEM_ZONE_DMA : MEM_ZONE_NORMAL];
+}
+
+static inline uint32_t dir_base(uint32_t page_dir) {
+    return pae_enabled ? page_dir + PAGE_SIZE : page_dir;
+}
 
 // Initialize memory manager
 void memory_init(void) {
-    // Clear bitmap
-    for (int i = 0; i < BITMAP_SIZE; i++) {
-        page_bitmap[i] = 0;
+    const boot_info_t* info = (const boot_info_t*)BOOT_INFO_ADDR;
+    bool have_map = (info->magic == BOOT_INFO_MAGIC && info->e820_count > 0);
+    
+    for (int z = 0; z < MEM_ZONE_COUNT; z++) {
+        __builtin_memset(&zones[z], 0, sizeof(mem_zone_t));
+        for (int i = 0; i <= MEMORY_MAX_ORDER; i++) {
+            zones[z].free_lists[i] = FRAME_NONE;
+        }
+    }
+    
+    // PAE brings NX and 36-bit frames; use it whenever the CPU has it
+    pae_enabled = hal_cpu_enable_pae();
+    if (pae_enabled) {
+        nx_enabled = hal_cpu_enable_nx();
+        pde_shift = 21;
+        table_entries = 512;
+        dir_entries = PAE_PDPT_ENTRIES * 512;
+        dir_pages = 1 + PAE_PDPT_ENTRIES;
+    }
+    
+    // Size everything from the highest usable address
+    if (have_map) {
+        memory_scan_e820(info);
+    } else {
+        detected_pages = LEGACY_MEMORY_SIZE / PAGE_SIZE;
+        ram_start[0] = 0;
+        ram_end[0] = detected_pages;
+        ram_ranges = 1;
+    }
+    phys_pages = detected_pages;
+    if (phys_pages > DIRECT_MAP_LIMIT / PAGE_SIZE) {
+        phys_pages = DIRECT_MAP_LIMIT / PAGE_SIZE;
+    }
+    kernel_pdes = (phys_pages + table_entries - 1) / table_entries;
+    
+    // The frame database follows the kernel image
+    uint32_t kernel_end = PAGE_ALIGN((uint32_t)&__end);
+    uint32_t frames_end = PAGE_ALIGN(kernel_end + phys_pages * sizeof(page_frame_t));
+    if (frames_end > BOOT_MODULES_BASE) {
+        kernel_panic("Frame database overlaps boot modules");
+    }
+    frames = (page_frame_t*)kernel_end;
+    
+    // Everything starts reserved; usable ranges are released below
+    for (uint32_t i = 0; i < phys_pages; i++) {
+        frames[i].next = FRAME_NONE;
+        frames[i].prev = FRAME_NONE;
+        frames[i].order = 0;
+        frames[i].flags = FRAME_FLAG_RESERVED;
+        frames[i].type = MEM_TYPE_KERNEL;
+        frames[i].owner = 0;
+        frames[i].refcount = 0;
     }
     
-    // Mark first MB as reserved (BIOS, EBDA, Video memory etc)
-    for (uint32_t i = 0; i < (1024 * 1024) / PAGE_SIZE; i++) {
-        bitmap_set(i);
+    if (have_map) {
+        // Usable first, then every other type on top so overlaps stay reserved
+        uint32_t count = info->e820_count < BOOT_E820_MAX ? info->e820_count : BOOT_E820_MAX;
+        for (uint32_t i = 0; i < count; i++) {
+            if (info->e820[i].type == E820_USABLE) {
+                memory_mark_range(info->e820[i].base, info->e820[i].base + info->e820[i].length, 0);
+            }
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (info->e820[i].type != E820_USABLE) {
+                memory_mark_range(info->e820[i].base, info->e820[i].base + info->e820[i].length, FRAME_FLAG_RESERVED);
+            }
+        }
+    } else {
+        memory_mark_range(0, LEGACY_MEMORY_SIZE, 0);
     }
     
-    // Mark kernel as reserved
-    // Kernel is loaded at 1MB, let's assume it's up to 2MB for now
-    for (uint32_t i = (1024 * 1024) / PAGE_SIZE; i < (2 * 1024 * 1024) / PAGE_SIZE; i++) {
-        bitmap_set(i);
+    // Low memory, the kernel image with its frame database, and the boot modules
+    memory_mark_range(0, LOW_MEMORY_END, FRAME_FLAG_RESERVED);
+    memory_mark_range(KERNEL_BASE, frames_end, FRAME_FLAG_RESERVED);
+    memory_mark_range(BOOT_MODULES_BASE, BOOT_MODULES_BASE + BOOT_MODULES_SIZE, FRAME_FLAG_RESERVED);
+    
+    // Hand every free run to the buddy allocator
+    uint32_t run_start = 0;
+    for (uint32_t i = 0; i <= phys_pages; i++) {
+        if (i < phys_pages && frames[i].flags == 0) {
+            continue;
+        }
+        if (i > run_start) {
+            buddy_free_range(run_start, i - run_start);
+        }
+        run_start = i + 1;
+    }
+    for (int z = 0; z < MEM_ZONE_COUNT; z++) {
+        zone_init_watermarks(&zones[z]);
     }
     
     // Create kernel page directory
-    kernel_page_dir = (uint32_t)memory_alloc_pages(1);
-    __builtin_memset((void*)kernel_page_dir, 0, PAGE_SIZE);
+    kernel_page_dir = memory_create_page_directory(0);
+    
+    // Kernel mappings are identical in every directory, so keep them across CR3 loads
+    if (hal_cpu_enable_global_pages()) {
+        kernel_page_flags |= PAGE_GLOBAL;
+    }
     
-    // Map kernel space (identity map first 16MB) - but keep page 0 unmapped for User
-    memory_map_kernel(kernel_page_dir);
+    // Map the kernel with large pages when available so it needs no page tables
+    kernel_large_pages = pae_enabled || hal_cpu_enable_large_pages();
+    
+    // Build the kernel identity map once; process directories share its tables
+    memory_build_kernel_map();
     
     // Load kernel page directory
     hal_cpu_enable_paging(kernel_page_dir);
     
     kernel_print("Memory manager initialized\r\n");
     kernel_print("Total memory: ");
-    kernel_print_hex(MEMORY_SIZE);
-    kernel_print(" bytes\r\n");
+    kernel_print_hex(detected_pages * (PAGE_SIZE / 1024));
+    kernel_print(" KB, managed: ");
+    kernel_print_hex(phys_pages * (PAGE_SIZE / 1024));
+    kernel_print(" KB\r\n");
+    kernel_print(pae_enabled ? (nx_enabled ? "Paging: PAE with NX\r\n" : "Paging: PAE\r\n") : "Paging: 32-bit\r\n");
+    kernel_print("Zones: DMA ");
+    kernel_print_hex(zones[MEM_ZONE_DMA].present_pages * (PAGE_SIZE / 1024));
+    kernel_print(" KB, normal ");
+    kernel_print_hex(zones[MEM_ZONE_NORMAL].present_pages * (PAGE_SIZE / 1024));
+    kernel_print(" KB\r\n");
 }
 
-// Map kernel space identity mapping into a page directory
+// Find the highest usable address in the E820 map, capped at what the paging mode can address
+static void memory_scan_e820(const boot_info_t* info) {
+    uint32_t count = info->e820_count < BOOT_E820_MAX ? info->e820_count : BOOT_E820_MAX;
+    uint64_t limit = pae_enabled ? (1ULL << 36) : (1ULL << 32);
+    uint64_t top = 0;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        if (info->e820[i].type != E820_USABLE) {
+            continue;
+        }
+        uint64_t start = info->e820[i].base;
+        uint64_t end = start + info->e820[i].length;
+        if (end > top) {
+            top = end;
+        }
+        if (start < limit) {
+            ram_start[ram_ranges] = (uint32_t)(start >> 12);
+            ram_end[ram_ranges] = (uint32_t)(((end < limit) ? end : limit) >> 12);
+            ram_ranges++;
+        }
+    }
+    if (top > limit) {
+        top = limit;
+    }
+    detected_pages = (uint32_t)(top >> 12);
+}
+
+// Set the state of every tracked frame touching [start, end)
+static void memory_mark_range(uint64_t start, uint64_t end, uint8_t flags) {
+    // Usable ranges shrink to whole pages, reserved ones grow
+    uint64_t first = flags ? (start >> 12) : ((start + PAGE_SIZE - 1) >> 12);
+    uint64_t last = flags ? ((end + PAGE_SIZE - 1) >> 12) : (end >> 12);
+    
+    if (last > phys_pages) {
+        last = phys_pages;
+    }
+    for (uint64_t i = first; i < last; i++) {
+        frames[(uint32_t)i].flags = flags;
+    }
+}
+
+// Build the identity map of managed memory in the kernel page directory
+static void memory_build_kernel_map(void) {
+    // Map all managed memory as Supervisor-only
+    // Keep it all Supervisor-only except what's specifically mapped for user
+    if (kernel_large_pages) {
+        uint32_t dir = dir_base(kernel_page_dir);
+        for (uint32_t i = 0; i < kernel_pdes; i++) {
+            pt_set(dir, i, (i << pde_shift) | PDE_LARGE | kernel_page_flags);
+        }
+    } else {
+        memory_map_range(kernel_page_dir, 0, 0, kernel_pdes * table_entries, kernel_page_flags);
+    }
+}
+
+// Share the kernel identity mapping with a page directory
 void memory_map_kernel(uint32_t page_dir) {
-    // Map entire kernel memory (16MB) as Supervisor-only
-    uint32_t total_pages = MEMORY_SIZE / PAGE_SIZE;
+    if (page_dir == kernel_page_dir) {
+        return;
+    }
     
-    for (uint32_t i = 0; i < total_pages; i++) {
-        uint32_t phys_addr = i * PAGE_SIZE;
-        uint32_t virt_addr = phys_addr;
-        
-        // Page 0 remains Supervisor-only (no User flag)
-        // Rest of kernel (up to 4MB) remains Supervisor-only
-        // Wait, for stability let's keep it all Supervisor-only except what's specifically mapped for user
-        memory_map_page(page_dir, virt_addr, phys_addr, 0x03); // Present, RW, Supervisor
+    // Copy the directory entries only; the page tables stay shared
+    uint32_t entry_size = pae_enabled ? 8 : 4;
+    __builtin_memcpy((void*)dir_base(page_dir), (void*)dir_base(kernel_page_dir), kernel_pdes * entry_size);
+    if (kernel_mmio_pde) {
+        pt_set(dir_base(page_dir), kernel_mmio_pde, pt_get(dir_base(kernel_page_dir), kernel_mmio_pde));
     }
 }
 
+// Map a device page (the local APIC) into the kernel at its physical address,
+// uncached and above user space. Every directory shares the one table behind
+// it, so all such pages must fall in a single directory entry. Returns the
+// virtual address, or 0.
+uint32_t memory_map_mmio(uint32_t phys_addr) {
+    uint32_t page = phys_addr & ~0xFFF;
+    uint32_t pd_index = page >> pde_shift;
+    if (page < USER_STACK_TOP || !memory_is_device(page)) {
+        return 0;
+    }
+    if (kernel_mmio_pde && pd_index != kernel_mmio_pde) {
+        return 0;
+    }
+    memory_map_page(kernel_page_dir, page, page, kernel_page_flags | 0x18);  // PWT, PCD
+    kernel_mmio_pde = pd_index;
+    return phys_addr;
+}
+
+// Check whether a directory entry still points at a shared kernel table
+static bool memory_is_kernel_table(uint32_t pd_index, uint32_t pde) {
+    if ((pd_index >= kernel_pdes && pd_index != kernel_mmio_pde) || !(pde & 0x01) || (pde & PDE_LARGE)) {
+        return false;
+    }
+    uint32_t kernel_pde = pt_get(dir_base(kernel_page_dir), pd_index);
+    return (pde & ~0xFFF) == (kernel_pde & ~0xFFF);
+}
+
 // Map a single page
 void memory_map_page(uint32_t page_dir, uint32_t virt_addr, uint32_t phys_addr, uint32_t flags) {
-    uint32_t pd_index = virt_addr >> 22;
-    uint32_t pt_index = (virt_addr >> 12) & 0x3FF;
-    
-    uint32_t* pd = (uint32_t*)page_dir;
-    uint32_t* page_table;
-    
-    if (!(pd[pd_index] & 0x01)) {
-        // Create new page table
-        page_table = (uint32_t*)memory_alloc_pages(1);
-        __builtin_memset(page_table, 0, PAGE_SIZE);
-        // OR flags from map request into the directory entry to allow user access to the table itself
-        pd[pd_index] = (uint32_t)page_table | (flags & 0x07);
-    } else {
-        page_table = (uint32_t*)(pd[pd_index] & ~0xFFF);
-        // If we are mapping a user page, ensure the page directory entry also has the User flag
-        if (flags & 0x04) {
-             pd[pd_index] |= 0x04;
+    memory_update_range(page_dir, virt_addr, phys_addr, 1, flags, true);
+}
+
+// Unmap a single page
+void memory_unmap_page(uint32_t page_dir, uint32_t virt_addr) {
+    memory_update_range(page_dir, virt_addr, 0, 1, 0, false);
+}
+
+// Map count contiguous pages
+void memory_map_range(uint32_t page_dir, uint32_t virt_addr, uint32_t phys_addr, uint32_t count, uint32_t flags) {
+    memory_update_range(page_dir, virt_addr, phys_addr, count, flags, true);
+}
+
+// Unmap count contiguous pages (frames are not freed)
+void memory_unmap_range(uint32_t page_dir, uint32_t virt_addr, uint32_t count) {
+    memory_update_range(page_dir, virt_addr, 0, count, 0, false);
+}
+
+// Write a run of PTEs, looking each page table up once
+static void memory_update_range(uint32_t page_dir, uint32_t virt_addr, uint32_t phys_addr,
+                                uint32_t count, uint32_t flags, bool map) {
+    uint32_t dir = dir_base(page_dir);
+    uint32_t page_table = 0;
+    uint32_t table_index = 0xFFFFFFFF;
+    uint32_t large_pde = 0;
+    uint32_t large_mask = ~((1U << pde_shift) - 1);
+    bool shared = false;
+    
+    // Only the active directory can have stale TLB entries
+    bool active = (page_dir == hal_cpu_get_cr3());
+    bool batch = (count > TLB_INVLPG_MAX);
+    bool need_flush = false;
+    bool need_global_flush = false;
+    
+    virt_addr &= ~0xFFF;
+    phys_addr &= ~0xFFF;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t virt = virt_addr + i * PAGE_SIZE;
+        uint32_t pd_index = virt >> pde_shift;
+        uint32_t pt_index = (virt >> 12) & (table_entries - 1);
+        
+        if (pd_index != table_index) {
+            uint32_t pde = pt_get(dir, pd_index);
+            table_index = pd_index;
+            large_pde = 0;
+            if ((pde & 0x01) && (pde & PDE_LARGE)) {
+                // Split lazily, only once a PTE inside actually changes
+                large_pde = pde;
+                page_table = 0;
+            } else if (pde & 0x01) {
+                page_table = pde & ~0xFFF;
+                shared = (page_dir != kernel_page_dir && memory_is_kernel_table(pd_index, pde));
+                // If we are mapping a user page, ensure the page directory entry also has the User flag
+                if (map && (flags & 0x04)) {
+                    pt_set(dir, pd_index, pde | 0x04);
+                }
+            } else if (map) {
+                // Create new page table
+                page_table = (uint32_t)memory_alloc_pages_flags(1, ALLOC_ZERO);
+                if (!page_table) break;
+                memory_tag_pages((void*)page_table, 1, MEM_TYPE_PAGE_TABLE, dir_owner(page_dir));
+                // OR flags from map request into the directory entry to allow user access to the table itself
+                pt_set(dir, pd_index, page_table | (flags & 0x07));
+                shared = false;
+            } else {
+                page_table = 0;
+            }
+        }
+        
+        if (!page_table && !large_pde) {
+            continue;
+        }
+        
+        uint32_t entry = map ? ((phys_addr + i * PAGE_SIZE) | (flags & 0xFFF) | 0x01) : 0;
+        uint32_t old;
+        if (large_pde) {
+            old = ((large_pde & large_mask) + (pt_index << 12)) | (large_pde & LARGE_PAGE_FLAGS);
+        } else {
+            old = pt_get(page_table, pt_index);
+        }
+        if ((old & ~(PAGE_GLOBAL | PAGE_HW_BITS)) == entry) {
+            continue;  // Already mapped this way
+        }
+        
+        // A 4KB change inside a large page needs a real page table
+        if (large_pde) {
+            page_table = memory_split_large_page(dir, pd_index);
+            if (!page_table) break;
+            large_pde = 0;
+            shared = false;
+            if (map && (flags & 0x04)) {
+                pt_set(dir, pd_index, pt_get(dir, pd_index) | 0x04);
+            }
+        }
+        
+        // Take a private copy before changing a shared kernel table
+        if (shared) {
+            void* copy = memory_alloc_pages(1);
+            if (!copy) break;
+            memory_tag_pages(copy, 1, MEM_TYPE_PAGE_TABLE, dir_owner(page_dir));
+            __builtin_memcpy(copy, (void*)page_table, PAGE_SIZE);
+            pt_set(dir, pd_index, (uint32_t)copy | (pt_get(dir, pd_index) & 0xFFF));
+            page_table = (uint32_t)copy;
+            shared = false;
+        }
+        
+        pt_set(page_table, pt_index, entry);
+        
+        // Non-present entries are never cached, so only replaced mappings need invalidation.
+        // Global entries survive CR3 loads and may be cached whatever directory is active.
+        if ((old & 0x01) && (active || (old & PAGE_GLOBAL))) {
+            if (!batch) {
+                hal_cpu_invlpg(virt);
+                tlb_invlpgs++;
+            } else if (old & PAGE_GLOBAL) {
+                need_global_flush = true;
+            } else {
+                need_flush = true;
+            }
         }
     }
     
-    page_table[pt_index] = (phys_addr & ~0xFFF) | (flags & 0xFFF) | 0x01;
-    hal_cpu_flush_tlb();
+    if (need_global_flush) {
+        hal_cpu_flush_tlb_global();
+        tlb_full_flushes++;
+    } else if (need_flush) {
+        hal_cpu_flush_tlb();
+        tlb_full_flushes++;
+    }
+    
+    // Previously every page cost a full flush
+    tlb_flushes_avoided += count - ((need_flush || need_global_flush) ? 1 : 0);
+}
+
+// Replace a large directory entry with a page table mapping the same range
+static uint32_t memory_split_large_page(uint32_t dir, uint32_t pd_index) {
+    uint32_t pde = pt_get(dir, pd_index);
+    uint32_t page_table = (uint32_t)memory_alloc_pages(1);
+    if (!page_table) {
+        return 0;
+    }
+    memory_tag_pages((void*)page_table, 1, MEM_TYPE_PAGE_TABLE, dir_owner(dir));
+    
+    uint32_t base = pde & ~((1U << pde_shift) - 1);
+    uint32_t pte_flags = pde & LARGE_PAGE_FLAGS;
+    for (uint32_t i = 0; i < table_entries; i++) {
+        pt_set(page_table, i, (base + (i << 12)) | pte_flags);
+    }
+    
+    // The large TLB entry is dropped by the invlpg of whichever PTE changes next
+    pt_set(dir, pd_index, page_table | (pde & 0x07));
+    return page_table;
+}
+
+// Look up the PTE for a virtual address (0 if unmapped)
+uint32_t memory_get_pte(uint32_t page_dir, uint32_t virt_addr) {
+    uint32_t pde = pt_get(dir_base(page_dir), virt_addr >> pde_shift);
+    uint32_t offset_mask = (1U << pde_shift) - 1;
+    if (!(pde & 0x01)) {
+        return 0;
+    }
+    if (pde & PDE_LARGE) {
+        return ((pde & ~offset_mask) + (virt_addr & offset_mask & ~0xFFF)) | (pde & LARGE_PAGE_FLAGS);
+    }
+    return pt_get(pde & ~0xFFF, (virt_addr >> 12) & (table_entries - 1));
+}
+
+// Get TLB maintenance counters
+void memory_get_tlb_stats(uint32_t* full_flushes, uint32_t* invlpgs, uint32_t* flushes_avoided) {
+    if (full_flushes) *full_flushes = tlb_full_flushes;
+    if (invlpgs) *invlpgs = tlb_invlpgs;
+    if (flushes_avoided) *flushes_avoided = tlb_flushes_avoided;
+}
+
+// Report the paging mode chosen at boot
+bool memory_pae_enabled(void) {
+    return pae_enabled;
+}
+
+// Create process page directory (in PAE mode a PDPT followed by its four directories).
+// A recycled directory already holds the kernel entries; memory_map_kernel refreshes them.
+// The directory and every table added to it later are charged to owner_pid.
+uint32_t memory_create_page_directory(uint32_t owner_pid) {
+    if (dir_cache_count > 0) {
+        uint32_t page_dir = dir_cache[--dir_cache_count];
+        memory_tag_pages((void*)page_dir, dir_pages, MEM_TYPE_PAGE_TABLE, owner_pid);
+        return page_dir;
+    }
+    
+    uint32_t page_dir = (uint32_t)memory_alloc_pages_flags(dir_pages, ALLOC_ZERO);
+    memory_tag_pages((void*)page_dir, dir_pages, MEM_TYPE_PAGE_TABLE, owner_pid);
+    if (page_dir && pae_enabled) {
+        for (uint32_t i = 0; i < PAE_PDPT_ENTRIES; i++) {
+            pt_set(page_dir, i, (page_dir + (i + 1) * PAGE_SIZE) | 0x01);
+        }
+    }
+    return page_dir;
 }
 
-// Create process page directory
-uint32_t memory_create_page_directory(void) {
-    uint32_t* pd = (uint32_t*)memory_alloc_pages(1);
-    if (!pd) return 0;
-    __builtin_memset(pd, 0, PAGE_SIZE);
-    return (uint32_t)pd;
+// Free the user page tables behind directory entries [first, first + count),
+// dropping the references their mappings hold. Returns the entry to go on
+// from, or 0 once the end of the directory is reached.
+uint32_t memory_release_user_tables(uint32_t page_dir, uint32_t first, uint32_t count) {
+    uint32_t dir = dir_base(page_dir);
+    uint32_t end = (count < dir_entries - first) ? first + count : dir_entries;
+    for (uint32_t i = first; i < end; i++) {
+        uint32_t pde = pt_get(dir, i);
+        if ((pde & 0x01) && !(pde & PDE_LARGE) && !memory_is_kernel_table(i, pde)) {
+            uint32_t page_table = pde & ~0xFFF;
+            for (uint32_t j = 0; j < table_entries; j++) {
+                uint32_t pte = pt_get(page_table, j);
+                if ((pte & 0x05) == 0x05) {
+                    memory_page_put(pte & ~0xFFF);
+                }
+            }
+            memory_free_pages((void*)page_table, 1);
+            pt_set(dir, i, 0);
+        }
+    }
+    return end < dir_entries ? end : 0;
 }
 
-// Destroy page directory
+// Destroy page directory, dropping the references held by its user mappings
 void memory_destroy_page_directory(uint32_t page_dir) {
-    uint32_t* pd = (uint32_t*)page_dir;
-    for (int i = 0; i < 1024; i++) {
-        if (pd[i] & 0x01) {
-            memory_free_pages((void*)(pd[i] & ~0xFFF), 1);
+    memory_release_user_tables(page_dir, 0, dir_entries);
+    
+    // Every user entry is clear now, so the directory can serve the next process.
+    // It was not the active CR3, so no TLB entries refer to it.
+    if (dir_cache_count < DIR_CACHE_SIZE && page_dir != kernel_page_dir) {
+        memory_map_kernel(page_dir);
+        memory_tag_pages((void*)page_dir, dir_pages, MEM_TYPE_PAGE_TABLE, 0);
+        dir_cache[dir_cache_count++] = page_dir;
+        return;
+    }
+    memory_free_pages((void*)page_dir, dir_pages);
+}
+
+// Share every user page of src with dst, both sides read-only until written
+// (shared memory pages stay writable).
+// Private tables are copied whole, so the cost is one table copy per directory entry in use.
+uint32_t memory_clone_user_pages(uint32_t src_dir, uint32_t dst_dir) {
+    uint32_t src = dir_base(src_dir);
+    uint32_t dst = dir_base(dst_dir);
+    uint32_t shared = 0;
+    
+    for (uint32_t i = 0; i < dir_entries; i++) {
+        uint32_t src_pde = pt_get(src, i);
+        if (!(src_pde & 0x01) || (src_pde & PDE_LARGE) || memory_is_kernel_table(i, src_pde)) {
+            continue;
+        }
+        uint32_t page_table = src_pde & ~0xFFF;
+        for (uint32_t j = 0; j < table_entries; j++) {
+            uint32_t pte = pt_get(page_table, j);
+            if ((pte & 0x05) != 0x05) {
+                continue;
+            }
+            if ((pte & 0x02) && !(pte & PAGE_SHARED)) {
+                pt_set(page_table, j, (pte & ~0x02) | PAGE_COW);
+            }
+            memory_page_get(pte & ~0xFFF);
+            shared++;
+        }
+        
+        // Kernel entries in a split table are identity mappings, valid in any directory
+        uint32_t dst_pde = pt_get(dst, i);
+        bool dst_private = (dst_pde & 0x01) && !(dst_pde & PDE_LARGE) && !memory_is_kernel_table(i, dst_pde);
+        void* copy = dst_private ? NULL : memory_alloc_pages(1);
+        if (copy) {
+            memory_tag_pages(copy, 1, MEM_TYPE_PAGE_TABLE, dir_owner(dst_dir));
+            __builtin_memcpy(copy, (void*)page_table, PAGE_SIZE);
+            pt_set(dst, i, (uint32_t)copy | (src_pde & 0xFFF));
+            continue;
+        }
+        
+        // The destination already has its own table here; merge the user entries
+        for (uint32_t j = 0; j < table_entries; j++) {
+            uint32_t pte = pt_get(page_table, j);
+            if ((pte & 0x05) == 0x05) {
+                memory_map_page(dst_dir, (i << pde_shift) | (j << 12), pte & ~0xFFF, pte & 0xFFF & ~PAGE_HW_BITS);
+            }
+        }
+    }
+    
+    // Writable entries of the source may still be cached; user pages are never global
+    if (shared && src_dir == hal_cpu_get_cr3()) {
+        hal_cpu_flush_tlb();
+        tlb_full_flushes++;
+    }
+    return shared;
+}
+
+// Give a write-faulting copy-on-write page its own frame, owned by owner_pid
+bool memory_resolve_cow(uint32_t page_dir, uint32_t virt_addr, uint32_t owner_pid) {
+    virt_addr &= ~0xFFF;
+    uint32_t pte = memory_get_pte(page_dir, virt_addr);
+    if ((pte & (PAGE_COW | 0x01)) != (PAGE_COW | 0x01)) {
+        return false;
+    }
+    
+    uint32_t old_frame = pte & ~0xFFF;
+    uint32_t flags = ((pte & 0xFFF) & ~(PAGE_COW | PAGE_HW_BITS)) | 0x02;
+    
+    // A copy of MMIO would cut both processes off from the device
+    if (memory_is_device(old_frame)) {
+        return false;
+    }
+    
+    // The last holder of an allocated frame can simply take it over
+    uint32_t frame = old_frame / PAGE_SIZE;
+    uint32_t type = (frame < phys_pages) ? frames[frame].type : MEM_TYPE_USER;
+    if (memory_page_refcount(old_frame) == 1) {
+        memory_tag_pages((void*)old_frame, 1, type, owner_pid);
+        memory_map_page(page_dir, virt_addr, old_frame, flags);
+        return true;
+    }
+    
+    void* copy = memory_alloc_pages(1);
+    if (!copy) {
+        return false;
+    }
+    __builtin_memcpy(copy, (void*)old_frame, PAGE_SIZE);
+    memory_tag_pages(copy, 1, type, owner_pid);
+    memory_map_page(page_dir, virt_addr, (uint32_t)copy, flags);
+    memory_page_put(old_frame);
+    return true;
+}
+
+// True when phys_addr is not RAM: MMIO, option ROMs and firmware ranges that a
+// driver may map without exposing memory the allocator hands out
+bool memory_is_device(uint32_t phys_addr) {
+    uint32_t frame = phys_addr / PAGE_SIZE;
+    if (phys_addr >= 0xA0000 && phys_addr < LOW_MEMORY_END) {
+        return true;  // Legacy video memory and ROMs, whatever the map says
+    }
+    for (uint32_t i = 0; i < ram_ranges; i++) {
+        if (frame >= ram_start[i] && frame < ram_end[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Record what allocated pages are for and which process they belong to (0 for the kernel)
+void memory_tag_pages(void* addr, uint32_t count, uint32_t type, uint32_t owner_pid) {
+    uint32_t frame = (uint32_t)addr / PAGE_SIZE;
+    if (!addr || type >= MEM_TYPE_COUNT || frame >= phys_pages || count > phys_pages - frame) {
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (frames[frame + i].flags & FRAME_FLAG_USED) {
+            frame_unaccount(frame + i);
+            frame_account(frame + i, type, owner_pid);
+        }
+    }
+}
+
+// Get allocated pages per MEM_TYPE_* (MEM_TYPE_COUNT entries)
+void memory_get_type_stats(uint32_t* pages_by_type) {
+    if (!pages_by_type) {
+        return;
+    }
+    for (int i = 0; i < MEM_TYPE_COUNT; i++) {
+        pages_by_type[i] = type_pages[i];
+    }
+}
+
+// Get allocated pages owned by a process (pid 0 is the kernel, which also
+// holds frames that outlived their owner). A stale PID owns nothing.
+uint32_t memory_get_process_pages(uint32_t pid) {
+    if (pid >= PID_MAX || owner_slot_pid[PID_SLOT(pid)] != pid) {
+        return 0;
+    }
+    return owner_pages[PID_SLOT(pid)];
+}
+
+// Get page directory and table pages charged to a process
+uint32_t memory_get_process_table_pages(uint32_t pid) {
+    if (pid >= PID_MAX || owner_slot_pid[PID_SLOT(pid)] != pid) {
+        return 0;
+    }
+    return owner_table_pages[PID_SLOT(pid)];
+}
+
+// Hand the frames still charged to pid to the kernel as its slot goes back:
+// copy-on-write pages a child still maps, shared memory other processes map.
+// The frames keep the old PID, which no longer matches the slot.
+void memory_release_owner(uint32_t pid) {
+    uint32_t slot = PID_SLOT(pid);
+    if (pid == 0 || pid >= PID_MAX || owner_slot_pid[slot] != pid) {
+        return;
+    }
+    owner_pages[0] += owner_pages[slot];
+    owner_table_pages[0] += owner_table_pages[slot];
+    owner_pages[slot] = 0;
+    owner_table_pages[slot] = 0;
+    owner_slot_pid[slot] = 0;
+}
+
+// Fill a SYS_MEMORY_STATS record from the counters; nothing is scanned
+void memory_get_process_stats(pcb_t* process, memory_stats_t* stats) {
+    if (!stats) {
+        return;
+    }
+    __builtin_memset(stats, 0, sizeof(memory_stats_t));
+    stats->total_pages = phys_pages;
+    stats->used_pages = total_allocated_pages;
+    memory_get_type_stats(stats->pages_by_type);
+    for (uint32_t z = 0; z < MEM_ZONE_COUNT; z++) {
+        memory_get_zone_stats(z, &stats->zones[z]);
+    }
+    if (process) {
+        stats->pid = process->pid;
+        stats->resident_pages = process->resident_pages;
+        stats->page_table_pages = memory_get_process_table_pages(process->pid);
+        stats->ipc_bytes = process->ipc_bytes;
+        stats->regions = process->region_count;
+        stats->soft_limit = process->mem_soft_limit;
+        stats->hard_limit = process->mem_hard_limit;
+    }
+}
+
+// Take an extra reference on an allocated frame (reserved frames are ignored)
+void memory_page_get(uint32_t phys_addr) {
+    uint32_t frame = phys_addr / PAGE_SIZE;
+    if (frame < phys_pages && (frames[frame].flags & FRAME_FLAG_USED)) {
+        frames[frame].refcount++;
+    }
+}
+
+// Drop a reference, freeing the frame with the last one
+void memory_page_put(uint32_t phys_addr) {
+    uint32_t frame = phys_addr / PAGE_SIZE;
+    if (frame < phys_pages && (frames[frame].flags & FRAME_FLAG_USED)) {
+        if (--frames[frame].refcount == 0) {
+            memory_free_pages((void*)(frame * PAGE_SIZE), 1);
         }
     }
-    memory_free_pages((void*)pd, 1);
+}
+
+// References held on a frame (0 for free or reserved frames)
+uint32_t memory_page_refcount(uint32_t phys_addr) {
+    uint32_t frame = phys_addr / PAGE_SIZE;
+    if (frame >= phys_pages || !(frames[frame].flags & FRAME_FLAG_USED)) {
+        return 0;
+    }
+    return frames[frame].refcount;
 }
 
 // Allocate physical pages
 void* memory_alloc_pages(uint32_t count) {
-    for (uint32_t i = 0; i < PHYS_PAGES - count; i++) {
-        bool free = true;
-        for (uint32_t j = 0; j < count; j++) {
-            if (bitmap_test(i + j)) {
-                free = false;
-                break;
+    return memory_alloc_pages_flags(count, 0);
+}
+
+// Allocate physical pages; ALLOC_ZERO returns them cleared, from the zero pool when possible
+void* memory_alloc_pages_flags(uint32_t count, uint32_t flags) {
+    if (count == 0 || count > (1U << MEMORY_MAX_ORDER)) {
+        return NULL;
+    }
+    
+    // The zero pool may hold pages from either zone
+    bool pool_ok = !(flags & ALLOC_DMA) && zero_pool_head != FRAME_NONE;
+    if (count == 1 && (flags & ALLOC_ZERO) && pool_ok) {
+        zero_pool_hits++;
+        return (void*)(zero_pool_take() * PAGE_SIZE);
+    }
+    
+    void* pages = buddy_alloc(count, flags);
+    if (!pages && count == 1 && pool_ok) {
+        // Out of free blocks; the pool is the last reserve
+        pages = (void*)(zero_pool_take() * PAGE_SIZE);
+        flags &= ~ALLOC_ZERO;
+    }
+    if (pages && (flags & ALLOC_ZERO)) {
+        __builtin_memset(pages, 0, count * PAGE_SIZE);
+        zero_pool_misses += count;
+    }
+    return pages;
+}
+
+// Clear up to max free pages into the zero pool; returns how many were added.
+// Runs from the idle task with interrupts enabled, which stay on while a page is cleared.
+uint32_t memory_zero_pool_refill(uint32_t max) {
+    uint32_t added = 0;
+    
+    while (added < max) {
+        hal_cpu_disable_interrupts();
+        void* page = NULL;
+        if (zero_pool_count < ZERO_POOL_TARGET) {
+            // Only from a zone comfortably above its high watermark
+            for (int z = MEM_ZONE_COUNT - 1; z >= 0 && !page; z--) {
+                if (zones[z].free_pages > zones[z].watermark_high) {
+                    page = buddy_alloc_zone(&zones[z], 1);
+                }
             }
         }
-        
-        if (free) {
-            for (uint32_t j = 0; j < count; j++) {
-                bitmap_set(i + j);
-            }
-            total_allocated_pages += count;
-            return (void*)(i * PAGE_SIZE);
+        hal_cpu_enable_interrupts();
+        if (!page) {
+            break;
         }
+        
+        __builtin_memset(page, 0, PAGE_SIZE);
+        
+        hal_cpu_disable_interrupts();
+        uint32_t frame = (uint32_t)page / PAGE_SIZE;
+        frame_unaccount(frame);
+        frames[frame].flags = FRAME_FLAG_ZEROED;
+        frames[frame].refcount = 0;
+        frames[frame].next = zero_pool_head;
+        zero_pool_head = frame;
+        zero_pool_count++;
+        total_allocated_pages--;
+        hal_cpu_enable_interrupts();
+        added++;
+    }
+    return added;
+}
+
+// Get zero pool counters; hits / (hits + misses) is the share of clearing kept off the hot path
+void memory_get_zero_stats(uint32_t* pool_pages, uint32_t* hits, uint32_t* misses) {
+    if (pool_pages) *pool_pages = zero_pool_count;
+    if (hits) *hits = zero_pool_hits;
+    if (misses) *misses = zero_pool_misses;
+}
+
+// Pop one cleared frame from the zero pool
+static uint32_t zero_pool_take(void) {
+    uint32_t frame = zero_pool_head;
+    zero_pool_head = frames[frame].next;
+    zero_pool_count--;
+    frames[frame].next = FRAME_NONE;
+    frames[frame].flags = FRAME_FLAG_USED;
+    frames[frame].refcount = 1;
+    frame_account(frame, MEM_TYPE_KERNEL, 0);
+    total_allocated_pages++;
+    return frame;
+}
+
+// Counter slot for a frame owner; frames of a released PID count for the kernel
+static inline uint32_t owner_slot(uint32_t owner) {
+    uint32_t slot = PID_SLOT(owner);
+    return (owner_slot_pid[slot] == owner) ? slot : 0;
+}
+
+// Count an allocated frame under its type and owner. The first frame charged
+// to a PID claims its slot's counters.
+static void frame_account(uint32_t frame, uint32_t type, uint32_t owner) {
+    if (owner >= PID_MAX) {
+        owner = 0;
+    }
+    if (owner_slot_pid[PID_SLOT(owner)] == 0) {
+        owner_slot_pid[PID_SLOT(owner)] = owner;
+    }
+    uint32_t slot = owner_slot(owner);
+    frames[frame].type = type;
+    frames[frame].owner = (slot || owner == 0) ? owner : 0;
+    type_pages[type]++;
+    owner_pages[slot]++;
+    if (type == MEM_TYPE_PAGE_TABLE) {
+        owner_table_pages[slot]++;
+    }
+}
+
+static void frame_unaccount(uint32_t frame) {
+    uint32_t slot = owner_slot(frames[frame].owner);
+    type_pages[frames[frame].type]--;
+    owner_pages[slot]--;
+    if (frames[frame].type == MEM_TYPE_PAGE_TABLE) {
+        owner_table_pages[slot]--;
     }
-    return NULL;
 }
 
 // Free physical pages
 void memory_free_pages(void* ptr, uint32_t count) {
-    uint32_t page = (uint32_t)ptr / PAGE_SIZE;
+    uint32_t addr = (uint32_t)ptr;
+    uint32_t frame = addr / PAGE_SIZE;
+    
+    if (!ptr || count == 0) {
+        return;
+    }
+    if ((addr & (PAGE_SIZE - 1)) || frame >= phys_pages || count > phys_pages - frame) {
+        kernel_print("memory_free_pages: invalid range ");
+        kernel_print_hex(addr);
+        kernel_print("\r\n");
+        return;
+    }
+    
     for (uint32_t i = 0; i < count; i++) {
-        bitmap_clear(page + i);
+        if (!(frames[frame + i].flags & FRAME_FLAG_USED)) {
+            kernel_print("memory_free_pages: page not allocated ");
+            kernel_print_hex((frame + i) * PAGE_SIZE);
+            kernel_print("\r\n");
+            return;
+        }
     }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        frame_unaccount(frame + i);
+        frames[frame + i].flags = 0;
+        frames[frame + i].refcount = 0;
+    }
+    buddy_free_range(frame, count);
     total_allocated_pages -= count;
 }
 
-// Bitmap helpers
-static void bitmap_set(uint32_t page) {
-    page_bitmap[page / 32] |= (1 << (page % 32));
+// Allocate physically contiguous pages below 16MB for device DMA. Blocks are
+// naturally aligned, so buffers up to 64KB never cross a 64KB ISA DMA boundary.
+void* memory_alloc_dma(uint32_t count) {
+    return memory_alloc_pages_flags(count, ALLOC_DMA);
 }
 
-static void bitmap_clear(uint32_t page) {
-    page_bitmap[page / 32] &= ~(1 << (page % 32));
+// Get one zone's free pages and watermarks
+void memory_get_zone_stats(uint32_t zone, memory_zone_stats_t* stats) {
+    if (zone >= MEM_ZONE_COUNT || !stats) {
+        return;
+    }
+    stats->present_pages = zones[zone].present_pages;
+    stats->free_pages = zones[zone].free_pages;
+    stats->lowest_free = zones[zone].lowest_free;
+    stats->watermark_min = zones[zone].watermark_min;
+    stats->watermark_low = zones[zone].watermark_low;
+    stats->watermark_high = zones[zone].watermark_high;
 }
 
-static bool bitmap_test(uint32_t page) {
-    return (page_bitmap[page / 32] & (1 << (page % 32))) != 0;
+// Zone helpers
+
+// Size the watermarks from what the zone got at boot
+static void zone_init_watermarks(mem_zone_t* zone) {
+    zone->present_pages = zone->free_pages;
+    zone->lowest_free = zone->free_pages;
+    if (zone->present_pages == 0) {
+        return;
+    }
+    uint32_t min = zone->present_pages / 128;
+    if (min < ZONE_WATERMARK_FLOOR) {
+        min = ZONE_WATERMARK_FLOOR;
+    }
+    zone->watermark_min = min;
+    zone->watermark_low = min * 2;
+    zone->watermark_high = min * 3;
 }
 
-void memory_get_stats(uint32_t* total, uint32_t* used) {
-    if (total) *total = MEMORY_SIZE;
+// Buddy helpers
+
+// Pick the zone for an allocation. Generic callers take the normal zone first and
+// only dip into low memory while it stays above its low watermark.
+static void* buddy_alloc(uint32_t count, uint32_t flags) {
+    mem_zone_t* dma = &zones[MEM_ZONE_DMA];
+    if (flags & ALLOC_DMA) {
+        return buddy_alloc_zone(dma, count);
+    }
+    void* pages = buddy_alloc_zone(&zones[MEM_ZONE_NORMAL], count);
+    if (!pages && dma->free_pages >= dma->watermark_low + count) {
+        pages = buddy_alloc_zone(dma, count);
+    }
+    return pages;
+}
+
+// Take a block from one zone's free lists
+static void* buddy_alloc_zone(mem_zone_t* zone, uint32_t count) {
+    uint32_t order = buddy_order_for(count);
+    
+    // Smallest non-empty order that fits, in one bsf
+    uint32_t fits = zone->order_mask & ~((1U << order) - 1);
+    if (!fits) {
+        return NULL;
+    }
+    uint32_t current = __builtin_ctz(fits);
+    
+    uint32_t frame = zone->free_lists[current];
+    buddy_list_remove(frame, current);
+    
+    // Split down to the requested order, returning upper halves
+    while (current > order) {
+        current--;
+        buddy_list_push(frame + (1U << current), current);
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        frames[frame + i].flags = FRAME_FLAG_USED;
+        frames[frame + i].refcount = 1;
+        frame_account(frame + i, MEM_TYPE_KERNEL, 0);
+    }
+    
+    // Give back the tail of a rounded-up block
+    if (count < (1U << order)) {
+        buddy_free_range(frame + count, (1U << order) - count);
+    }
+    
+    total_allocated_pages += count;
+    
+    if (zone->free_pages < zone->lowest_free) {
+        zone->lowest_free = zone->free_pages;
+    }
+    if (zone->free_pages < zone->watermark_min && !zone->short_reported) {
+        kernel_print(zone == &zones[MEM_ZONE_DMA] ? "memory: DMA zone" : "memory: normal zone");
+        kernel_print(" below min watermark\r\n");
+        zone->short_reported = true;
+    } else if (zone->free_pages > zone->watermark_high) {
+        zone->short_reported = false;
+    }
+    return (void*)(frame * PAGE_SIZE);
+}
+
+static void buddy_list_push(uint32_t frame, uint32_t order) {
+    mem_zone_t* zone = frame_zone(frame);
+    frames[frame].order = order;
+    frames[frame].flags = FRAME_FLAG_FREE;
+    frames[frame].prev = FRAME_NONE;
+    frames[frame].next = zone->free_lists[order];
+    if (zone->free_lists[order] != FRAME_NONE) {
+        frames[zone->free_lists[order]].prev = frame;
+    }
+    zone->free_lists[order] = frame;
+    zone->order_mask |= 1U << order;
+    zone->free_block_count[order]++;
+    zone->free_pages += 1U << order;
+}
+
+static void buddy_list_remove(uint32_t frame, uint32_t order) {
+    mem_zone_t* zone = frame_zone(frame);
+    page_frame_t* f = &frames[frame];
+    if (f->prev != FRAME_NONE) {
+        frames[f->prev].next = f->next;
+    } else {
+        zone->free_lists[order] = f->next;
+        if (f->next == FRAME_NONE) {
+            zone->order_mask &= ~(1U << order);
+        }
+    }
+    if (f->next != FRAME_NONE) {
+        frames[f->next].prev = f->prev;
+    }
+    f->next = FRAME_NONE;
+    f->prev = FRAME_NONE;
+    f->flags &= ~FRAME_FLAG_FREE;
+    zone->free_block_count[order]--;
+    zone->free_pages -= 1U << order;
+}
+
+// Free one aligned block, merging with its buddy while possible
+static void buddy_free_block(uint32_t frame, uint32_t order) {
+    while (order < MEMORY_MAX_ORDER) {
+        uint32_t buddy = frame ^ (1U << order);
+        if (buddy >= phys_pages ||
+            !(frames[buddy].flags & FRAME_FLAG_FREE) ||
+            frames[buddy].order != order) {
+            break;
+        }
+        buddy_list_remove(buddy, order);
+        frame &= ~(1U << order);
+        order++;
+    }
+    buddy_list_push(frame, order);
+}
+
+// Free an arbitrary run of frames as a series of maximal aligned blocks
+static void buddy_free_range(uint32_t frame, uint32_t count) {
+    while (count > 0) {
+        // Largest block that is aligned at frame and fits in count
+        uint32_t order = 31 - __builtin_clz(count);
+        if (frame && (uint32_t)__builtin_ctz(frame) < order) {
+            order = __builtin_ctz(frame);
+        }
+        if (order > MEMORY_MAX_ORDER) {
+            order = MEMORY_MAX_ORDER;
+        }
+        buddy_free_block(frame, order);
+        frame += 1U << order;
+        count -= 1U << order;
+    }
+}
+
+// Smallest order whose block holds count pages
+static uint32_t buddy_order_for(uint32_t count) {
+    return count > 1 ? 32 - __builtin_clz(count - 1) : 0;
+}
+
+// Report memory usage; free_blocks receives MEMORY_MAX_ORDER + 1 counts summed over the zones
+void memory_get_stats(uint32_t* total, uint32_t* used, uint32_t* free_blocks) {
+    if (total) *total = phys_pages * PAGE_SIZE;
     if (used) *used = total_allocated_pages * PAGE_SIZE;
+    if (free_blocks) {
+        for (int i = 0; i <= MEMORY_MAX_ORDER; i++) {
+            free_blocks[i] = zones[MEM_ZONE_DMA].free_block_count[i] + zones[MEM_ZONE_NORMAL].free_block_count[i];
+        }
+    }
 }
@@ -5,14 +5,40 @@
 #include "hal.h"
 #include <stddef.h>
 
-// Process table
+// Saved trap frame layout: gs, fs, es, ds, pusha, int_no, err_code, iret frame
+#define TRAP_FRAME_WORDS 19
+#define TRAP_FRAME_EAX   11
+
+#define KERNEL_STACK_PAGES (KERNEL_STACK_SIZE / PAGE_SIZE)
+#define KSTACK_CACHE_SIZE  8   // Kernel stacks kept from exited processes
+#define REAPER_PRIORITY    1   // Below PRIORITY_DEFAULT, above the idle task
+#define REAP_TABLE_BATCH   16  // Directory entries the reaper tears down per step
+#define WAIT_CHILD         0x80000000  // waiting_for: blocked in process_wait on the PID below (0 for any)
+
+// Process table, indexed by PID_SLOT(pid). Free slots are kept on a stack and
+// each slot's generation goes into the next PID handed out from it.
 static pcb_t process_table[MAX_PROCESSES];
 static bool process_used[MAX_PROCESSES];
+static uint8_t free_slots[MAX_PROCESSES];
+static uint32_t free_slot_count = 0;
+static uint32_t slot_generation[MAX_PROCESSES];
+
+// Recycled kernel stacks; exit refills, creation drains
+static uint32_t kstack_cache[KSTACK_CACHE_SIZE];
+static uint32_t kstack_cache_count = 0;
+
+// Exited processes waiting for teardown; pushed from any context, taken whole by the reaper
+static pcb_t* volatile reap_list = NULL;
+static pcb_t* reaper = NULL;
 
 // Forward declarations
-static uint32_t process_allocate_pid(void);
 static void process_free_pid(uint32_t pid);
 static void process_cleanup(pcb_t* process);
+static void process_reap(pcb_t* process);
+static void process_reap_pause(void);
+static void process_release(pcb_t* process);
+static void process_reaper(void);
+bool process_reset_table(void);
 void process_setup_stack(pcb_t* process, uint32_t entry_point);
 
 // First run handler for USER processes (uses iret)
@@ -31,26 +57,36 @@ extern void first_run_user_handler(void);
 
 // Initialize process management
 void process_init(void) {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        process_used[i] = false;
-        __builtin_memset(&process_table[i], 0, sizeof(pcb_t));
-    }
+    process_reset_table();
     kernel_print("Process management initialized\r\n");
 }
 
-// Create new process (kernel or user)
-pcb_t* process_create_internal(uint32_t parent_pid, bool is_user) {
-    int slot = -1;
+// Return the process table and PID allocator to their boot state, so the next
+// process is PID 1 again. Fails while any process exists.
+bool process_reset_table(void) {
     for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (!process_used[i]) {
-            slot = i;
-            break;
+        if (process_used[i]) {
+            return false;
         }
     }
-    if (slot == -1) return NULL;
-    
-    uint32_t pid = process_allocate_pid();
-    if (pid == 0) return NULL;
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        slot_generation[i] = 0;
+        __builtin_memset(&process_table[i], 0, sizeof(pcb_t));
+    }
+    // Slot 0 stays free for the kernel's PID 0; lower slots are handed out first
+    free_slot_count = 0;
+    for (int i = MAX_PROCESSES - 1; i > 0; i--) {
+        free_slots[free_slot_count++] = i;
+    }
+    return true;
+}
+
+// Create new process (kernel or user); clones take their user stack from the parent
+pcb_t* process_create_internal(uint32_t parent_pid, bool is_user, bool clone) {
+    // The slot only leaves the free stack once creation has succeeded
+    if (free_slot_count == 0) return NULL;
+    uint32_t slot = free_slots[free_slot_count - 1];
+    uint32_t pid = slot_generation[slot] * MAX_PROCESSES + slot;
     
     pcb_t* process = &process_table[slot];
     __builtin_memset(process, 0, sizeof(pcb_t));
@@ -58,89 +94,201 @@ pcb_t* process_create_internal(uint32_t parent_pid, bool is_user) {
     process->pid = pid;
     process->parent_pid = parent_pid;
     process->state = PROCESS_CREATED;
-    process->priority = 5;
+    process->priority = PRIORITY_DEFAULT;
     process->is_user = is_user;
     
     // Each process gets its own page directory
-    process->page_directory = memory_create_page_directory();
+    process->page_directory = memory_create_page_directory(pid);
     if (!process->page_directory) return NULL;
     
-    // Identity map kernel into process space
+    // Share the kernel page tables with process space
     memory_map_kernel(process->page_directory);
     
-    process->kernel_stack = (uint32_t)memory_alloc_pages(2);
+    if (kstack_cache_count > 0) {
+        process->kernel_stack = kstack_cache[--kstack_cache_count];
+    } else {
+        process->kernel_stack = (uint32_t)memory_alloc_pages(KERNEL_STACK_PAGES);
+    }
     if (!process->kernel_stack) {
         process_cleanup(process);
         return NULL;
     }
+    memory_tag_pages((void*)process->kernel_stack, KERNEL_STACK_PAGES, MEM_TYPE_STACK, pid);
 
     // Map kernel stack into process page directory (Supervisor RW)
-    for (int i = 0; i < 2; i++) {
-        uint32_t addr = process->kernel_stack + i * PAGE_SIZE;
-        memory_map_page(process->page_directory, addr, addr, 0x03);
-    }
+    memory_map_range(process->page_directory, process->kernel_stack, process->kernel_stack, KERNEL_STACK_PAGES, 0x03);
 
-    if (is_user) {
-        process->user_stack = (uint32_t)memory_alloc_pages(4);
-        if (!process->user_stack) {
+    if (is_user && !clone) {
+        // User stack (User RW, no execute) below USER_STACK_TOP with a guard page under it.
+        // Pages are faulted in from the zero pool as the stack grows.
+        process->user_stack = USER_STACK_TOP - USER_STACK_SIZE;
+        if (vmm_alloc_fixed(process, process->user_stack, USER_STACK_SIZE / PAGE_SIZE, 0x07 | PAGE_NX) != STATUS_SUCCESS) {
             process_cleanup(process);
             return NULL;
         }
-        // Map user stack (User RW)
-        for (int i = 0; i < 4; i++) {
-            uint32_t addr = process->user_stack + i * PAGE_SIZE;
-            memory_map_page(process->page_directory, addr, addr, 0x07);
-        }
+        vmm_reserve(process, process->user_stack - PAGE_SIZE, 1);
     }
     
+    free_slot_count--;
     process_used[slot] = true;
     return process;
 }
 
 // Public API
 pcb_t* process_create(uint32_t parent_pid) {
-    return process_create_internal(parent_pid, true); // Default to user process
+    return process_create_internal(parent_pid, true, false); // Default to user process
 }
 
 pcb_t* process_create_kernel(void) {
-    return process_create_internal(0, false);
+    return process_create_internal(0, false, false);
+}
+
+// Fork a user process: the child shares every user page copy-on-write and
+// resumes from the parent's trap frame with a return value of 0
+pcb_t* process_clone(pcb_t* parent, const void* trap_frame) {
+    if (!parent || !parent->is_user || !trap_frame) return NULL;
+    
+    pcb_t* child = process_create_internal(parent->pid, true, true);
+    if (!child) return NULL;
+    
+    child->priority = parent->priority;
+    child->mem_soft_limit = parent->mem_soft_limit;
+    child->mem_hard_limit = parent->mem_hard_limit;
+    child->user_stack = parent->user_stack;
+    memory_clone_user_pages(parent->page_directory, child->page_directory);
+    
+    // Regions carry over; pages already mapped were shared above
+    if (vmm_clone(parent, child) != STATUS_SUCCESS) {
+        process_destroy(child);
+        return NULL;
+    }
+    
+    uint32_t* kernel_stack = (uint32_t*)(child->kernel_stack + KERNEL_STACK_SIZE);
+    kernel_stack -= TRAP_FRAME_WORDS;
+    __builtin_memcpy(kernel_stack, trap_frame, TRAP_FRAME_WORDS * sizeof(uint32_t));
+    kernel_stack[TRAP_FRAME_EAX] = 0;
+    
+    *--kernel_stack = (uint32_t)first_run_user_handler;
+    *--kernel_stack = 0x202; // Initial EFLAGS
+    *--kernel_stack = 0;     // EBP
+    *--kernel_stack = 0;     // EBX
+    *--kernel_stack = 0;     // ESI
+    *--kernel_stack = 0;     // EDI
+    
+    child->registers[4] = (uint32_t)kernel_stack;
+    return child;
 }
 
+// Stop a process and queue it for the reaper. The caller only pays for the
+// unlink; exiting the current process switches away and never returns.
 void process_exit(pcb_t* process, uint32_t exit_code) {
-    if (!process) return;
+    if (!process || process->state == PROCESS_TERMINATED || process->state == PROCESS_ZOMBIE) return;
     
     uint32_t pid = process->pid;
     kernel_print("Terminating Process ");
     kernel_print_hex(pid);
     kernel_print("\r\n");
 
-    process->state = PROCESS_TERMINATED;
     process->exit_code = exit_code;
+    bool self = (process == scheduler_get_current());
+    if (!self) {
+        scheduler_remove_process(process);
+    }
+    process->state = PROCESS_TERMINATED;
+
+    pcb_t* head;
+    do {
+        head = reap_list;
+        process->reap_next = head;
+    } while (!__sync_bool_compare_and_swap(&reap_list, head, process));
+    if (reaper) {
+        scheduler_unblock_process(reaper);
+    }
+
+    if (self) {
+        scheduler_remove_process(process);
+    }
+}
+
+// Tear a process down synchronously and release its slot and PID without
+// leaving a zombie. Must not be used on the current process.
+void process_destroy(pcb_t* process) {
+    if (!process) return;
     
     scheduler_remove_process(process);
-    
-    process_cleanup(process);
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (&process_table[i] == process) {
-            process_used[i] = false;
-            break;
-        }
-    }
-    process_free_pid(pid);
+    process->state = PROCESS_TERMINATED;
+    process->parent_pid = 0;
+    process_reap(process);
 }
 
 status_t process_kill(uint32_t pid) {
     pcb_t* process = process_find(pid);
     if (!process) return STATUS_NOT_FOUND;
+    if (process == reaper) return STATUS_PERMISSION_DENIED;
     process_exit(process, 0);
     return STATUS_SUCCESS;
 }
 
+// Collect an exited child of parent (pid, or any child for 0), blocking until
+// one exits. Returns the child's PID, or STATUS_NOT_FOUND if none matches.
+status_t process_wait(pcb_t* parent, uint32_t pid, uint32_t* exit_code) {
+    if (!parent) return STATUS_INVALID_PARAM;
+    
+    while (1) {
+        bool found = false;
+        for (int i = 0; i < MAX_PROCESSES; i++) {
+            pcb_t* child = &process_table[i];
+            if (!process_used[i] || child->parent_pid != parent->pid || child == parent) continue;
+            if (pid && child->pid != pid) continue;
+            found = true;
+            if (child->state == PROCESS_ZOMBIE) {
+                uint32_t child_pid = child->pid;
+                if (exit_code) *exit_code = child->exit_code;
+                process_release(child);
+                return (status_t)child_pid;
+            }
+        }
+        if (!found) return STATUS_NOT_FOUND;
+        
+        // The reaper wakes us when a matching child becomes a zombie
+        parent->waiting_for = WAIT_CHILD | pid;
+        scheduler_block_current();
+    }
+}
+
+// Find a live process in any state; exited ones only remain visible to process_wait.
+// A stale PID names an older generation of its slot and is not found.
 pcb_t* process_find(uint32_t pid) {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (process_used[i] && process_table[i].pid == pid) return &process_table[i];
+    pcb_t* process = process_at_slot(PID_SLOT(pid));
+    if (!process || process->pid != pid) {
+        return NULL;
+    }
+    return process;
+}
+
+// Get the live process in a table slot, if any
+pcb_t* process_at_slot(uint32_t slot) {
+    if (slot == 0 || slot >= MAX_PROCESSES || !process_used[slot]) {
+        return NULL;
+    }
+    pcb_t* process = &process_table[slot];
+    if (process->state == PROCESS_TERMINATED || process->state == PROCESS_ZOMBIE) {
+        return NULL;
     }
-    return NULL;
+    return process;
+}
+
+// Start the reaper task; processes that exit before it runs wait on the list
+void process_reaper_init(void) {
+    pcb_t* task = process_create_kernel();
+    if (!task) {
+        kernel_print("Failed to create reaper task\r\n");
+        return;
+    }
+    process_setup_stack(task, (uint32_t)process_reaper);
+    scheduler_set_priority(task, REAPER_PRIORITY);
+    scheduler_add_process(task);
+    reaper = task;
 }
 
 void process_setup_stack(pcb_t* process, uint32_t entry_point) {
@@ -202,25 +350,119 @@ void process_setup_stack(pcb_t* process, uint32_t entry_point) {
 
 static void process_cleanup(pcb_t* process) {
     if (!process) return;
+    vmm_destroy(process);
     if (process->page_directory && process->page_directory != kernel_page_dir) {
+        // Never free the directory we are running on
+        if (hal_cpu_get_cr3() == process->page_directory) {
+            hal_cpu_set_cr3(kernel_page_dir);
+        }
         memory_destroy_page_directory(process->page_directory);
     }
-    if (process->kernel_stack) memory_free_pages((void*)process->kernel_stack, 2);
-    if (process->user_stack) memory_free_pages((void*)process->user_stack, 4);
+    // Kernel stacks go back to the cache while it has room
+    if (process->kernel_stack) {
+        if (kstack_cache_count < KSTACK_CACHE_SIZE) {
+            memory_tag_pages((void*)process->kernel_stack, KERNEL_STACK_PAGES, MEM_TYPE_STACK, 0);
+            kstack_cache[kstack_cache_count++] = process->kernel_stack;
+        } else {
+            memory_free_pages((void*)process->kernel_stack, KERNEL_STACK_PAGES);
+        }
+    }
 }
 
-static uint32_t process_allocate_pid(void) {
-    static uint32_t next_pid = 1;
-    for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
-        uint32_t pid = (next_pid + i) % MAX_PROCESSES;
-        if (pid == 0) continue;
-        bool used = false;
-        for (int j = 0; j < MAX_PROCESSES; j++) {
-            if (process_used[j] && process_table[j].pid == pid) { used = true; break; }
+// Reaper task body: free exited processes in the background. Each teardown
+// step runs with interrupts off but is bounded (one region, or a few directory
+// entries); interrupts and anything runnable get in between steps.
+static void process_reaper(void) {
+    while (1) {
+        hal_cpu_disable_interrupts();
+        pcb_t* list = __sync_lock_test_and_set(&reap_list, NULL);
+        if (!list) {
+            // Interrupts stay off until we are blocked, so no wakeup is lost
+            scheduler_block_current();
+            hal_cpu_enable_interrupts();
+            continue;
+        }
+        while (list) {
+            pcb_t* next = list->reap_next;
+            process_reap(list);
+            process_reap_pause();
+            list = next;
         }
-        if (!used) { next_pid = pid + 1; return pid; }
+        hal_cpu_enable_interrupts();
     }
-    return 0;
 }
 
-static void process_free_pid(uint32_t pid) { (void)pid; }
+// Free everything an exited process holds. With a live parent it stays a
+// zombie until collected; otherwise its slot and PID go back at once.
+static void process_reap(pcb_t* process) {
+    uint32_t pid = process->pid;
+    ipc_clear_queue(pid);
+    process_reap_pause();
+    while (vmm_destroy_step(process)) {
+        process_reap_pause();
+    }
+    uint32_t page_dir = process->page_directory;
+    if (page_dir && page_dir != kernel_page_dir) {
+        uint32_t entry = 0;
+        while ((entry = memory_release_user_tables(page_dir, entry, REAP_TABLE_BATCH)) != 0) {
+            process_reap_pause();
+        }
+    }
+    // Only the emptied directory and the kernel stack are left
+    process_cleanup(process);
+    process->page_directory = 0;
+    process->kernel_stack = 0;
+    process->reap_next = NULL;
+
+    // Nobody will collect this process's children now
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        pcb_t* child = &process_table[i];
+        if (!process_used[i] || child == process || child->parent_pid != pid) continue;
+        child->parent_pid = 0;
+        if (child->state == PROCESS_ZOMBIE) {
+            process_release(child);
+        }
+    }
+
+    pcb_t* parent = process->parent_pid ? process_find(process->parent_pid) : NULL;
+    if (!parent) {
+        process_release(process);
+        return;
+    }
+    process->state = PROCESS_ZOMBIE;
+    if (parent->state == PROCESS_BLOCKED && (parent->waiting_for & WAIT_CHILD)) {
+        uint32_t wanted = parent->waiting_for & ~WAIT_CHILD;
+        if (wanted == 0 || wanted == pid) {
+            parent->waiting_for = 0;
+            scheduler_unblock_process(parent);
+        }
+    }
+}
+
+// Between two teardown steps: take pending interrupts, then let anything
+// runnable go first. Interrupts are off again on return. Only the reaper
+// pauses; process_destroy callers (fork failure, boot) tear down in one go.
+static void process_reap_pause(void) {
+    if (!reaper || scheduler_get_current() != reaper) {
+        return;
+    }
+    hal_cpu_enable_interrupts();
+    hal_cpu_disable_interrupts();
+    scheduler_yield();
+}
+
+// Give a torn-down process's slot and PID back
+static void process_release(pcb_t* process) {
+    shm_revoke(process->pid);
+    memory_release_owner(process->pid);
+    process_used[process - process_table] = false;
+    process_free_pid(process->pid);
+}
+
+// Retire a PID: the slot's next process gets the following generation, and the
+// slot goes on top of the free stack so it is reused while still cache-warm
+static void process_free_pid(uint32_t pid) {
+    uint32_t slot = PID_SLOT(pid);
+    slot_generation[slot] = (slot_generation[slot] + 1) % PID_GENERATIONS;
+    free_slots[free_slot_count++] = slot;
+}
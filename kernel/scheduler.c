@@ -1,22 +1,40 @@
 // Kernel Scheduler
-// Round-robin process scheduling
+// O(1) priority scheduling over per-level run queues
 
 #include "kernel.h"
 #include "hal.h"
 #include <stddef.h>
 
-// Scheduler state
+#define QUANTUM_PER_LEVEL_US 2000  // Quantum grows by this many microseconds per priority level
+#define IDLE_ZERO_BATCH 8          // Pages the idle task clears before offering the CPU again
+
+// One FIFO per priority level and a bitmap of the non-empty ones
+typedef struct run_array {
+    uint32_t bitmap;
+    pcb_t* head[PRIORITY_LEVELS];
+    pcb_t* tail[PRIORITY_LEVELS];
+} run_array_t;
+
+// Scheduler state. Ready processes wait in the active array; once they yield or
+// use up their quantum they move to the expired array, and the two swap when
+// the active one runs dry. Idle-priority tasks only run when both are empty.
 static pcb_t* current_process = NULL;
-static pcb_t* ready_queue_head = NULL;
-static pcb_t* ready_queue_tail = NULL;
-static uint32_t next_pid = 1;
+static run_array_t arrays[2];
+static run_array_t idle_array;
+static run_array_t* active = &arrays[0];
+static run_array_t* expired = &arrays[1];
+static pcb_t* sleep_head = NULL;   // Sleeping processes, earliest wake time first
 static uint32_t scheduler_ticks = 0;
 
-#define TIME_QUANTUM 10
-
 // Forward declarations
-static void scheduler_add_to_ready(pcb_t* process);
+static void scheduler_add_to_ready(pcb_t* process, run_array_t* array);
 static void scheduler_remove_from_ready(pcb_t* process);
+static pcb_t* scheduler_pick_next(void);
+static void scheduler_sleep_link(pcb_t* process, uint32_t deadline);
+static void scheduler_sleep_unlink(pcb_t* process);
+static void scheduler_timer_events(uint32_t now);
+static void scheduler_charge(pcb_t* process, uint32_t now);
+static void scheduler_arm_event(void);
 
 // Assembly context switch (Linker will handle the label)
 extern void context_switch_asm(pcb_t* from, pcb_t* to);
@@ -51,20 +69,24 @@ __asm__ (
 
 void scheduler_init(void) {
     current_process = NULL;
-    ready_queue_head = NULL;
-    ready_queue_tail = NULL;
-    next_pid = 1;
+    __builtin_memset(arrays, 0, sizeof(arrays));
+    __builtin_memset(&idle_array, 0, sizeof(idle_array));
+    active = &arrays[0];
+    expired = &arrays[1];
+    sleep_head = NULL;
     scheduler_ticks = 0;
     kernel_print("Scheduler initialized\r\n");
 }
 
 void scheduler_add_process(pcb_t* process) {
     if (!process) return;
-    if (process->pid == 0) process->pid = next_pid++;
     
     if (process->state == PROCESS_READY) return;
     
-    scheduler_add_to_ready(process);
+    if (process->time_slice == 0) {
+        process->time_slice = scheduler_quantum(process->priority);
+    }
+    scheduler_add_to_ready(process, active);
     process->state = PROCESS_READY;
 }
 
@@ -74,6 +96,9 @@ void scheduler_remove_process(pcb_t* process) {
     if (process->state == PROCESS_READY) {
         scheduler_remove_from_ready(process);
     }
+    if (process->sleeping) {
+        scheduler_sleep_unlink(process);
+    }
     
     if (process == current_process) {
         current_process = NULL;
@@ -82,66 +107,221 @@ void scheduler_remove_process(pcb_t* process) {
     }
 }
 
+// Timer interrupt: a tick, or a clock event the scheduler asked for
 void scheduler_tick(void) {
+    uint32_t now = hal_timer_get_us();
     scheduler_ticks++;
+    scheduler_timer_events(now);
     if (!current_process) {
         scheduler_yield();
         return;
     }
-    current_process->cpu_time++;
-    if (scheduler_ticks % TIME_QUANTUM == 0) {
-        scheduler_yield();
+    if (now - current_process->slice_start < current_process->time_slice) {
+        // Woken sleepers wait for the end of the quantum
+        scheduler_arm_event();
+        return;
     }
+    scheduler_charge(current_process, now);
+    scheduler_yield();
+    scheduler_arm_event();
 }
 
-void scheduler_yield(void) {
-    pcb_t* next_process = ready_queue_head;
-    
-    if (!next_process) {
-        if (current_process && current_process->state == PROCESS_RUNNING) return;
-        return;
+// Microseconds a process may run before it is preempted; higher priorities run longer
+uint32_t scheduler_quantum(uint32_t priority) {
+    return priority ? priority * QUANTUM_PER_LEVEL_US : QUANTUM_PER_LEVEL_US / 2;
+}
+
+// Charge the time used since the process was last charged; a used-up quantum is refilled
+static void scheduler_charge(pcb_t* process, uint32_t now) {
+    uint32_t used = now - process->slice_start;
+    process->slice_start = now;
+    process->cpu_time += used;
+    if (used < process->time_slice) {
+        process->time_slice -= used;
+    } else {
+        process->time_slice = scheduler_quantum(process->priority);
     }
-    
+}
+
+// Ask for a clock event when the running quantum ends, or earlier for a sleeper.
+// The idle task has no quantum to enforce.
+static void scheduler_arm_event(void) {
+    pcb_t* process = current_process;
+    bool timed = process && process->priority != PRIORITY_IDLE;
+    uint32_t deadline = timed ? process->slice_start + process->time_slice : 0;
+    if (sleep_head && (!timed || (int32_t)(sleep_head->wake_time - deadline) < 0)) {
+        deadline = sleep_head->wake_time;
+        timed = true;
+    }
+    if (timed) {
+        hal_timer_set_event(deadline);
+    }
+}
+
+void scheduler_yield(void) {
     if (current_process && current_process->state == PROCESS_RUNNING) {
+        // Keep running when nobody else but the idle task is waiting
+        if (!active->bitmap && !expired->bitmap && current_process->priority != PRIORITY_IDLE) {
+            return;
+        }
         current_process->state = PROCESS_READY;
-        scheduler_add_to_ready(current_process);
+        scheduler_add_to_ready(current_process, expired);
     }
     
-    next_process = ready_queue_head;
+    pcb_t* next_process = scheduler_pick_next();
+    if (!next_process) {
+        return;
+    }
     scheduler_remove_from_ready(next_process);
     
     scheduler_switch_to(next_process);
 }
 
+// Whether anything but the idle task is ready to run
+bool scheduler_has_ready(void) {
+    return active->bitmap || expired->bitmap;
+}
+
 void scheduler_switch_to(pcb_t* next) {
     pcb_t* prev = current_process;
+    uint32_t now = hal_timer_get_us();
+    if (prev) {
+        scheduler_charge(prev, now);
+    }
     current_process = next;
     next->state = PROCESS_RUNNING;
+    next->slice_start = now;
+    scheduler_arm_event();
     
     if (prev != next) {
         kernel_print("S");
+        // Enter the next address space and give ring 3 a kernel stack to trap onto
+        hal_tss_set_esp0(next->kernel_stack + KERNEL_STACK_SIZE);
+        if (next->page_directory && next->page_directory != hal_cpu_get_cr3()) {
+            hal_cpu_set_cr3(next->page_directory);
+        }
         context_switch_asm(prev, next);
     }
 }
 
+// Idle task body: do background work while the CPU is otherwise unused
+void scheduler_idle(void) {
+    while (1) {
+        uint32_t zeroed = memory_zero_pool_refill(IDLE_ZERO_BATCH);
+        hal_cpu_disable_interrupts();
+        scheduler_yield();
+        hal_cpu_enable_interrupts();
+        // Halt only with nothing left to do and nobody waiting to run. The
+        // periodic tick is stopped until the next timer event meanwhile.
+        if (zeroed == 0 && !scheduler_has_ready()) {
+            hal_cpu_disable_interrupts();
+            if (!scheduler_has_ready()) {
+                hal_timer_idle_enter(scheduler_next_event());
+                __asm__ volatile("sti; hlt; cli");
+                hal_timer_idle_exit();
+            }
+            hal_cpu_enable_interrupts();
+        }
+    }
+}
+
 pcb_t* scheduler_get_current(void) {
     return current_process;
 }
 
-pcb_t* scheduler_find_process(uint32_t pid) {
-    if (current_process && current_process->pid == pid) return current_process;
-    pcb_t* current = ready_queue_head;
-    while (current) {
-        if (current->pid == pid) return current;
-        current = current->next;
+// Block the current process for at least us microseconds
+void scheduler_sleep(uint32_t us) {
+    pcb_t* process = current_process;
+    if (!process || us == 0) {
+        return;
+    }
+    uint32_t deadline = hal_timer_get_us() + us;
+    
+    // Other wakeups (IPC) end the block early; sleep again until the deadline
+    while ((int32_t)(deadline - hal_timer_get_us()) > 0) {
+        if (!process->sleeping) {
+            scheduler_sleep_link(process, deadline);
+        }
+        scheduler_block_current();
+    }
+}
+
+// Insert into the sleep list behind everything due no later than deadline
+static void scheduler_sleep_link(pcb_t* process, uint32_t deadline) {
+    pcb_t* prev = NULL;
+    pcb_t* next = sleep_head;
+    while (next && (int32_t)(next->wake_time - deadline) <= 0) {
+        prev = next;
+        next = next->next;
     }
-    return NULL;
+    process->prev = prev;
+    process->next = next;
+    if (prev) {
+        prev->next = process;
+    } else {
+        sleep_head = process;
+    }
+    if (next) {
+        next->prev = process;
+    }
+    process->wake_time = deadline;
+    process->sleeping = true;
+}
+
+// Microseconds until the next sleeper or capability expiry is due, 0xFFFFFFFF for none.
+// Capabilities expire on ticks.
+uint32_t scheduler_next_event(void) {
+    uint32_t next = 0xFFFFFFFF;
+    if (sleep_head) {
+        int32_t delta = (int32_t)(sleep_head->wake_time - hal_timer_get_us());
+        next = delta > 0 ? (uint32_t)delta : 0;
+    }
+    uint32_t expiry = capability_next_expiration();
+    if (expiry) {
+        int32_t delta = (int32_t)(expiry - hal_timer_get_ticks());
+        uint32_t tick_us = 1000000 / hal_timer_get_frequency();
+        if (delta <= 0) {
+            next = 0;
+        } else if ((uint32_t)delta < next / tick_us) {
+            next = delta * tick_us;
+        }
+    }
+    return next;
+}
+
+// Wake sleepers and expire capabilities that have come due
+static void scheduler_timer_events(uint32_t now) {
+    while (sleep_head && (int32_t)(sleep_head->wake_time - now) <= 0) {
+        scheduler_unblock_process(sleep_head);
+    }
+    uint32_t expiry = capability_next_expiration();
+    if (expiry && (int32_t)(expiry - hal_timer_get_ticks()) <= 0) {
+        capability_cleanup_expired();
+    }
+}
+
+static void scheduler_sleep_unlink(pcb_t* process) {
+    if (process->prev) {
+        process->prev->next = process->next;
+    } else {
+        sleep_head = process->next;
+    }
+    if (process->next) {
+        process->next->prev = process->prev;
+    }
+    process->next = NULL;
+    process->prev = NULL;
+    process->sleeping = false;
 }
 
+// A woken process rejoins the active array with what is left of its quantum
 void scheduler_unblock_process(pcb_t* process) {
     if (process && process->state == PROCESS_BLOCKED) {
+        if (process->sleeping) {
+            scheduler_sleep_unlink(process);
+        }
         process->state = PROCESS_READY;
-        scheduler_add_to_ready(process);
+        scheduler_add_to_ready(process, active);
     }
 }
 
@@ -152,42 +332,77 @@ void scheduler_block_current(void) {
     }
 }
 
-static void scheduler_add_to_ready(pcb_t* process) {
+// Highest ready level, found with one bsr; swaps in the expired array when the active one is empty
+static pcb_t* scheduler_pick_next(void) {
+    if (!active->bitmap) {
+        run_array_t* swap = active;
+        active = expired;
+        expired = swap;
+    }
+    run_array_t* array = active->bitmap ? active : &idle_array;
+    if (!array->bitmap) return NULL;
+    return array->head[31 - __builtin_clz(array->bitmap)];
+}
+
+// Queue at the tail of the process's level; idle-priority tasks always go to the idle array
+static void scheduler_add_to_ready(pcb_t* process, run_array_t* array) {
     if (!process) return;
+    uint32_t level = process->priority;
+    if (level == PRIORITY_IDLE) {
+        array = &idle_array;
+    }
     process->next = NULL;
-    process->prev = NULL;
+    process->prev = array->tail[level];
+    process->run_array = array;
     
-    if (!ready_queue_head) {
-        ready_queue_head = process;
-        ready_queue_tail = process;
+    if (array->tail[level]) {
+        array->tail[level]->next = process;
     } else {
-        ready_queue_tail->next = process;
-        process->prev = ready_queue_tail;
-        ready_queue_tail = process;
+        array->head[level] = process;
+        array->bitmap |= 1U << level;
     }
+    array->tail[level] = process;
 }
 
 static void scheduler_remove_from_ready(pcb_t* process) {
-    if (!process) return;
+    if (!process || !process->run_array) return;
+    run_array_t* array = process->run_array;
+    uint32_t level = process->priority;
     
     if (process->prev) {
         process->prev->next = process->next;
-    } else if (ready_queue_head == process) {
-        ready_queue_head = process->next;
     } else {
-        return;
+        array->head[level] = process->next;
     }
-    
     if (process->next) {
         process->next->prev = process->prev;
-    } else if (ready_queue_tail == process) {
-        ready_queue_tail = process->prev;
+    } else {
+        array->tail[level] = process->prev;
+    }
+    if (!array->head[level]) {
+        array->bitmap &= ~(1U << level);
     }
     
     process->next = NULL;
     process->prev = NULL;
+    process->run_array = NULL;
 }
 
+// Change a process's level, moving it between queues if it is waiting to run
 void scheduler_set_priority(pcb_t* process, uint32_t priority) {
-    if (process) process->priority = priority;
+    if (!process) return;
+    if (priority >= PRIORITY_LEVELS) {
+        priority = PRIORITY_LEVELS - 1;
+    }
+    run_array_t* array = process->run_array;
+    if (array) {
+        scheduler_remove_from_ready(process);
+    }
+    process->priority = priority;
+    if (process->time_slice > scheduler_quantum(priority)) {
+        process->time_slice = scheduler_quantum(priority);
+    }
+    if (array) {
+        scheduler_add_to_ready(process, array == &idle_array ? active : array);
+    }
 }
@@ -0,0 +1,159 @@
+// Kernel Shared Memory
+// Page-granular objects mapped into several address spaces without copying
+
+#include "kernel.h"
+#include "hal.h"
+#include <stddef.h>
+
+static shm_object_t* shm_objects[SHM_MAX_OBJECTS];
+static kmem_cache_t* shm_cache = NULL;
+static uint32_t next_shm_id = 1;
+
+// Forward declarations
+static shm_object_t* shm_find(uint32_t id);
+static void shm_destroy(shm_object_t* object);
+
+static inline uint64_t shm_pid_bit(uint32_t pid) {
+    return 1ULL << (pid % MAX_PROCESSES);
+}
+
+// Initialize shared memory
+void shm_init(void) {
+    for (int i = 0; i < SHM_MAX_OBJECTS; i++) {
+        shm_objects[i] = NULL;
+    }
+    shm_cache = kmem_cache_create("shm_object", sizeof(shm_object_t), NULL);
+    kernel_print("Shared memory initialized\r\n");
+}
+
+// Create an object and map it into the creator; returns the address, or 0
+uint32_t shm_create(pcb_t* process, uint32_t size, uint32_t* id) {
+    if (!process || size == 0) {
+        return 0;
+    }
+    uint32_t pages = DIV_ROUND_UP(size, PAGE_SIZE);
+    if (pages > SHM_MAX_PAGES) {
+        return 0;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < SHM_MAX_OBJECTS; i++) {
+        if (!shm_objects[i]) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1) {
+        return 0;
+    }
+
+    shm_object_t* object = (shm_object_t*)kmem_cache_alloc(shm_cache);
+    if (!object) {
+        return 0;
+    }
+    object->frames = (uint32_t*)kmalloc(pages * sizeof(uint32_t));
+    if (!object->frames) {
+        kmem_cache_free(shm_cache, object);
+        return 0;
+    }
+
+    // Frames need not be contiguous; the object holds one reference on each
+    for (uint32_t i = 0; i < pages; i++) {
+        object->frames[i] = (uint32_t)memory_alloc_pages_flags(1, ALLOC_ZERO);
+        if (!object->frames[i]) {
+            object->pages = i;
+            shm_destroy(object);
+            return 0;
+        }
+        memory_tag_pages((void*)object->frames[i], 1, MEM_TYPE_SHM, process->pid);
+    }
+
+    object->id = next_shm_id++;
+    object->owner_pid = process->pid;
+    object->pages = pages;
+    object->mappings = 0;
+    object->granted = shm_pid_bit(process->pid);
+    shm_objects[slot] = object;
+
+    uint32_t addr = vmm_map_shared(process, object);
+    if (!addr) {
+        // Never mapped, so nothing else will drop it
+        shm_objects[slot] = NULL;
+        shm_destroy(object);
+        return 0;
+    }
+    if (id) *id = object->id;
+    return addr;
+}
+
+// Map an object into target_pid (0 for the caller); returns the address there, or 0.
+// The caller must own the object or have been given it; the target is given it here.
+uint32_t shm_map(pcb_t* caller, uint32_t id, uint32_t target_pid) {
+    shm_object_t* object = shm_find(id);
+    if (!caller || !object || !(object->granted & shm_pid_bit(caller->pid))) {
+        return 0;
+    }
+
+    pcb_t* target = target_pid ? process_find(target_pid) : caller;
+    if (!target || !target->is_user) {
+        return 0;
+    }
+
+    uint32_t addr = vmm_map_shared(target, object);
+    if (addr) {
+        object->granted |= shm_pid_bit(target->pid);
+    }
+    return addr;
+}
+
+// Count a new mapping of the object
+void shm_get(shm_object_t* object) {
+    if (object) {
+        object->mappings++;
+    }
+}
+
+// Drop a mapping; the last one frees the object and its frame references
+void shm_put(shm_object_t* object) {
+    if (!object || object->mappings == 0) {
+        return;
+    }
+    if (--object->mappings > 0) {
+        return;
+    }
+    for (int i = 0; i < SHM_MAX_OBJECTS; i++) {
+        if (shm_objects[i] == object) {
+            shm_objects[i] = NULL;
+            break;
+        }
+    }
+    shm_destroy(object);
+}
+
+// Drop pid's rights to map objects; called as its slot goes back, so the
+// next process in the slot starts with none
+void shm_revoke(uint32_t pid) {
+    for (int i = 0; i < SHM_MAX_OBJECTS; i++) {
+        if (shm_objects[i]) {
+            shm_objects[i]->granted &= ~shm_pid_bit(pid);
+        }
+    }
+}
+
+static shm_object_t* shm_find(uint32_t id) {
+    for (int i = 0; i < SHM_MAX_OBJECTS; i++) {
+        if (shm_objects[i] && shm_objects[i]->id == id) {
+            return shm_objects[i];
+        }
+    }
+    return NULL;
+}
+
+// Release the object's own frame references; mappings still hold theirs
+static void shm_destroy(shm_object_t* object) {
+    for (uint32_t i = 0; i < object->pages; i++) {
+        memory_page_put(object->frames[i]);
+    }
+    kfree(object->frames);
+    kmem_cache_free(shm_cache, object);
+}
@@ -0,0 +1,273 @@
+// Kernel Slab Allocator
+// Object caches and kmalloc size classes for small kernel objects
+
+#include "kernel.h"
+#include "hal.h"
+#include <stddef.h>
+
+#define SLAB_PAGES      2                       // Each slab is one order-1 buddy block
+#define SLAB_SIZE       (SLAB_PAGES * PAGE_SIZE)
+#define SLAB_ALIGN      8
+#define SLAB_MAX_CACHES 16
+#define SLAB_INDEX_NONE 0xFFFF
+
+#define KMALLOC_MIN_SHIFT 5                     // 32 bytes
+#define KMALLOC_MAX_SHIFT 11                    // 2048 bytes
+#define KMALLOC_CLASSES   (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+// Slab header, stored at the start of its SLAB_SIZE-aligned block
+typedef struct slab {
+    struct kmem_cache* cache;  // Owning cache
+    struct slab* next;         // Next slab in the cache list
+    struct slab* prev;         // Previous slab in the cache list
+    uint8_t* objects;          // First object in this slab
+    uint16_t free_head;        // First free object index
+    uint16_t in_use;           // Objects handed out
+    uint16_t next_free[];      // Free list links, one per object
+} slab_t;
+
+struct kmem_cache {
+    const char* name;          // Cache name for diagnostics
+    uint32_t object_size;      // Aligned object size
+    uint32_t objects_per_slab; // Objects that fit in one slab
+    void (*ctor)(void*);       // Run once per object when a slab is built
+    slab_t* partial;           // Slabs with free and used objects
+    slab_t* full;              // Slabs with no free objects
+    slab_t* empty;             // One cached slab with no used objects
+    uint32_t slab_count;       // Slabs owned by this cache
+    uint32_t active_objects;   // Objects currently allocated
+    uint32_t mem_type;         // MEM_TYPE_* tag for this cache's slab pages
+};
+
+static kmem_cache_t caches[SLAB_MAX_CACHES];
+static uint32_t cache_count = 0;
+static kmem_cache_t* kmalloc_caches[KMALLOC_CLASSES];
+static const char* kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+    "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+// Forward declarations
+static slab_t* slab_create(kmem_cache_t* cache);
+static void slab_list_add(slab_t** list, slab_t* slab);
+static void slab_list_remove(slab_t** list, slab_t* slab);
+
+// Initialize slab allocator and the kmalloc size classes
+void slab_init(void) {
+    cache_count = 0;
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], 1U << (KMALLOC_MIN_SHIFT + i), NULL);
+    }
+    kernel_print("Slab allocator initialized\r\n");
+}
+
+// Create an object cache
+kmem_cache_t* kmem_cache_create(const char* name, uint32_t size, void (*ctor)(void*)) {
+    if (cache_count >= SLAB_MAX_CACHES || size == 0) {
+        return NULL;
+    }
+
+    uint32_t object_size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+
+    // Each object costs its size plus one free list link
+    uint32_t count = (SLAB_SIZE - sizeof(slab_t)) / (object_size + sizeof(uint16_t));
+    while (count > 0) {
+        uint32_t header = (sizeof(slab_t) + count * sizeof(uint16_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+        if (header + count * object_size <= SLAB_SIZE) {
+            break;
+        }
+        count--;
+    }
+    if (count == 0) {
+        return NULL;
+    }
+
+    kmem_cache_t* cache = &caches[cache_count++];
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->objects_per_slab = count;
+    cache->ctor = ctor;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->slab_count = 0;
+    cache->active_objects = 0;
+    cache->mem_type = MEM_TYPE_SLAB;
+    return cache;
+}
+
+// Set the memory accounting type of slabs created from now on
+void kmem_cache_set_type(kmem_cache_t* cache, uint32_t type) {
+    if (cache) {
+        cache->mem_type = type;
+    }
+}
+
+// Allocate an object from a cache
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    if (!cache) {
+        return NULL;
+    }
+
+    slab_t* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            cache->empty = NULL;
+        } else {
+            slab = slab_create(cache);
+            if (!slab) {
+                return NULL;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    uint16_t index = slab->free_head;
+    slab->free_head = slab->next_free[index];
+    slab->in_use++;
+    cache->active_objects++;
+
+    if (slab->free_head == SLAB_INDEX_NONE) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    return slab->objects + index * cache->object_size;
+}
+
+// Return an object to its cache
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!obj) {
+        return;
+    }
+
+    slab_t* slab = (slab_t*)((uint32_t)obj & ~(SLAB_SIZE - 1));
+    if (slab->cache != cache || slab->in_use == 0) {
+        kernel_print("kmem_cache_free: bad object ");
+        kernel_print_hex((uint32_t)obj);
+        kernel_print("\r\n");
+        return;
+    }
+
+    uint16_t index = ((uint8_t*)obj - slab->objects) / cache->object_size;
+    bool was_full = (slab->free_head == SLAB_INDEX_NONE);
+
+    slab->next_free[index] = slab->free_head;
+    slab->free_head = index;
+    slab->in_use--;
+    cache->active_objects--;
+
+    if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (!cache->empty) {
+            cache->empty = slab;
+        } else {
+            cache->slab_count--;
+            memory_free_pages(slab, SLAB_PAGES);
+        }
+    }
+}
+
+// Get statistics for one cache
+void kmem_cache_get_stats(kmem_cache_t* cache, uint32_t* active, uint32_t* total, uint32_t* slabs) {
+    if (!cache) {
+        return;
+    }
+    if (active) *active = cache->active_objects;
+    if (total) *total = cache->slab_count * cache->objects_per_slab;
+    if (slabs) *slabs = cache->slab_count;
+}
+
+// Get statistics summed over every cache
+void slab_get_stats(uint32_t* slabs, uint32_t* active_bytes, uint32_t* total_bytes) {
+    uint32_t slab_sum = 0;
+    uint32_t active_sum = 0;
+
+    for (uint32_t i = 0; i < cache_count; i++) {
+        slab_sum += caches[i].slab_count;
+        active_sum += caches[i].active_objects * caches[i].object_size;
+    }
+
+    if (slabs) *slabs = slab_sum;
+    if (active_bytes) *active_bytes = active_sum;
+    if (total_bytes) *total_bytes = slab_sum * SLAB_SIZE;
+}
+
+// Allocate from the smallest fitting size class (up to 2048 bytes)
+void* kmalloc(uint32_t size) {
+    if (size == 0 || size > (1U << KMALLOC_MAX_SHIFT)) {
+        return NULL;
+    }
+
+    uint32_t index = 0;
+    while ((1U << (KMALLOC_MIN_SHIFT + index)) < size) {
+        index++;
+    }
+    return kmem_cache_alloc(kmalloc_caches[index]);
+}
+
+// Free memory returned by kmalloc
+void kfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    slab_t* slab = (slab_t*)((uint32_t)ptr & ~(SLAB_SIZE - 1));
+    kmem_cache_free(slab->cache, ptr);
+}
+
+// Build a new slab and thread its free list
+static slab_t* slab_create(kmem_cache_t* cache) {
+    slab_t* slab = (slab_t*)memory_alloc_pages(SLAB_PAGES);
+    if (!slab) {
+        return NULL;
+    }
+    memory_tag_pages(slab, SLAB_PAGES, cache->mem_type, 0);
+
+    uint32_t count = cache->objects_per_slab;
+    uint32_t header = (sizeof(slab_t) + count * sizeof(uint16_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->objects = (uint8_t*)slab + header;
+    slab->free_head = 0;
+    slab->in_use = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        slab->next_free[i] = (i + 1 < count) ? (uint16_t)(i + 1) : SLAB_INDEX_NONE;
+        if (cache->ctor) {
+            cache->ctor(slab->objects + i * cache->object_size);
+        }
+    }
+
+    cache->slab_count++;
+    return slab;
+}
+
+static void slab_list_add(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t** list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
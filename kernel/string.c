@@ -0,0 +1,109 @@
+// Kernel String Functions
+// memcpy/memset on rep movsd/stosd, with non-temporal stores for large blocks
+
+#include "kernel.h"
+#include "hal.h"
+#include "string_ops.h"
+
+#define STRING_NT_THRESHOLD (256 * 1024)  // Larger blocks would only evict the cache
+#define STRING_NT_ALIGN     64            // Streamed from a cache line boundary
+
+// Picked at boot from CPUID
+static bool nt_stores = false;
+
+// Forward declarations
+static void string_copy_nt(uint8_t* dest, const uint8_t* src, uint32_t n);
+static void string_fill_nt(uint8_t* dest, uint8_t value, uint32_t n);
+
+// Choose the copy routines for this CPU
+void string_init(void) {
+    // movnti only needs SSE2 and stores from general registers, so the
+    // scheduler still has no FPU/SSE state to save
+    nt_stores = (hal_cpu_get_features() & CPU_FEAT_SSE2) != 0;
+    kernel_print(nt_stores ? "memcpy: rep movsd, SSE2 non-temporal above 256KB\r\n" : "memcpy: rep movsd\r\n");
+}
+
+void* memcpy(void* dest, const void* src, uint32_t n) {
+    if (nt_stores && n >= STRING_NT_THRESHOLD) {
+        string_copy_nt((uint8_t*)dest, (const uint8_t*)src, n);
+    } else {
+        string_copy(dest, src, n);
+    }
+    return dest;
+}
+
+void* memset(void* s, int c, uint32_t n) {
+    if (nt_stores && n >= STRING_NT_THRESHOLD) {
+        string_fill_nt((uint8_t*)s, (uint8_t)c, n);
+    } else {
+        string_fill(s, (uint8_t)c, n);
+    }
+    return s;
+}
+
+// Copy 64 bytes per round with movnti, prefetching the source ahead
+static void string_copy_nt(uint8_t* dest, const uint8_t* src, uint32_t n) {
+    uint32_t head = (0U - (uint32_t)dest) & (STRING_NT_ALIGN - 1);
+    string_copy(dest, src, head);
+    dest += head;
+    src += head;
+    n -= head;
+
+    uint32_t rounds = n / STRING_NT_ALIGN;
+    if (rounds) {
+        __asm__ volatile(
+            "1:\n"
+            "prefetchnta 256(%%esi)\n"
+            "mov 0(%%esi), %%eax\n"  "mov 4(%%esi), %%edx\n"
+            "movnti %%eax, 0(%%edi)\n"  "movnti %%edx, 4(%%edi)\n"
+            "mov 8(%%esi), %%eax\n"  "mov 12(%%esi), %%edx\n"
+            "movnti %%eax, 8(%%edi)\n"  "movnti %%edx, 12(%%edi)\n"
+            "mov 16(%%esi), %%eax\n" "mov 20(%%esi), %%edx\n"
+            "movnti %%eax, 16(%%edi)\n" "movnti %%edx, 20(%%edi)\n"
+            "mov 24(%%esi), %%eax\n" "mov 28(%%esi), %%edx\n"
+            "movnti %%eax, 24(%%edi)\n" "movnti %%edx, 28(%%edi)\n"
+            "mov 32(%%esi), %%eax\n" "mov 36(%%esi), %%edx\n"
+            "movnti %%eax, 32(%%edi)\n" "movnti %%edx, 36(%%edi)\n"
+            "mov 40(%%esi), %%eax\n" "mov 44(%%esi), %%edx\n"
+            "movnti %%eax, 40(%%edi)\n" "movnti %%edx, 44(%%edi)\n"
+            "mov 48(%%esi), %%eax\n" "mov 52(%%esi), %%edx\n"
+            "movnti %%eax, 48(%%edi)\n" "movnti %%edx, 52(%%edi)\n"
+            "mov 56(%%esi), %%eax\n" "mov 60(%%esi), %%edx\n"
+            "movnti %%eax, 56(%%edi)\n" "movnti %%edx, 60(%%edi)\n"
+            "add $64, %%esi\n"
+            "add $64, %%edi\n"
+            "dec %%ecx\n"
+            "jnz 1b\n"
+            "sfence\n"
+            : "+D"(dest), "+S"(src), "+c"(rounds)
+            :
+            : "eax", "edx", "memory", "cc");
+    }
+    string_copy(dest, src, n & (STRING_NT_ALIGN - 1));
+}
+
+// Fill 64 bytes per round with movnti
+static void string_fill_nt(uint8_t* dest, uint8_t value, uint32_t n) {
+    uint32_t head = (0U - (uint32_t)dest) & (STRING_NT_ALIGN - 1);
+    string_fill(dest, value, head);
+    dest += head;
+    n -= head;
+
+    uint32_t rounds = n / STRING_NT_ALIGN;
+    if (rounds) {
+        __asm__ volatile(
+            "1:\n"
+            "movnti %2, 0(%0)\n"  "movnti %2, 4(%0)\n"  "movnti %2, 8(%0)\n"  "movnti %2, 12(%0)\n"
+            "movnti %2, 16(%0)\n" "movnti %2, 20(%0)\n" "movnti %2, 24(%0)\n" "movnti %2, 28(%0)\n"
+            "movnti %2, 32(%0)\n" "movnti %2, 36(%0)\n" "movnti %2, 40(%0)\n" "movnti %2, 44(%0)\n"
+            "movnti %2, 48(%0)\n" "movnti %2, 52(%0)\n" "movnti %2, 56(%0)\n" "movnti %2, 60(%0)\n"
+            "add $64, %0\n"
+            "dec %1\n"
+            "jnz 1b\n"
+            "sfence\n"
+            : "+r"(dest), "+r"(rounds)
+            : "r"(value * 0x01010101U)
+            : "memory", "cc");
+    }
+    string_fill(dest, value, n & (STRING_NT_ALIGN - 1));
+}
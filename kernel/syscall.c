@@ -20,9 +20,16 @@ static status_t sys_process_create(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_process_exit(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_process_yield(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_process_kill(uint32_t ebx, uint32_t ecx, uint32_t edx);
+static status_t sys_process_wait(uint32_t ebx, uint32_t ecx, uint32_t edx);
+static status_t sys_process_sleep(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_memory_alloc(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_memory_free(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_memory_map(uint32_t ebx, uint32_t ecx, uint32_t edx);
+static status_t sys_shm_create(uint32_t ebx, uint32_t ecx, uint32_t edx);
+static status_t sys_shm_map(uint32_t ebx, uint32_t ecx, uint32_t edx);
+static status_t sys_shm_unmap(uint32_t ebx, uint32_t ecx, uint32_t edx);
+static status_t sys_memory_stats(uint32_t ebx, uint32_t ecx, uint32_t edx);
+static status_t sys_memory_limit(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_ipc_send(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_ipc_receive(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_ipc_register(uint32_t ebx, uint32_t ecx, uint32_t edx);
@@ -31,6 +38,9 @@ static status_t sys_driver_request(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_system_shutdown(uint32_t ebx, uint32_t ecx, uint32_t edx);
 static status_t sys_debug_print(uint32_t ebx, uint32_t ecx, uint32_t edx);
 
+// Frame of the system call being handled, for calls that resume from it
+static syscall_frame_t* current_frame = NULL;
+
 // System call handler table
 static status_t (*syscall_table[256])(uint32_t, uint32_t, uint32_t);
 
@@ -44,9 +54,16 @@ void syscall_init(void) {
     syscall_table[SYS_PROCESS_EXIT]   = sys_process_exit;
     syscall_table[SYS_PROCESS_YIELD]  = sys_process_yield;
     syscall_table[SYS_PROCESS_KILL]   = sys_process_kill;
+    syscall_table[SYS_PROCESS_WAIT]   = sys_process_wait;
+    syscall_table[SYS_PROCESS_SLEEP]  = sys_process_sleep;
     syscall_table[SYS_MEMORY_ALLOC]  = sys_memory_alloc;
     syscall_table[SYS_MEMORY_FREE]   = sys_memory_free;
     syscall_table[SYS_MEMORY_MAP]    = sys_memory_map;
+    syscall_table[SYS_SHM_CREATE]    = sys_shm_create;
+    syscall_table[SYS_SHM_MAP]       = sys_shm_map;
+    syscall_table[SYS_SHM_UNMAP]     = sys_shm_unmap;
+    syscall_table[SYS_MEMORY_STATS]  = sys_memory_stats;
+    syscall_table[SYS_MEMORY_LIMIT]  = sys_memory_limit;
     syscall_table[SYS_IPC_SEND]      = sys_ipc_send;
     syscall_table[SYS_IPC_RECEIVE]   = sys_ipc_receive;
     syscall_table[SYS_IPC_REGISTER]  = sys_ipc_register;
@@ -74,6 +91,8 @@ void syscall_dispatch(void* frame_ptr) {
         kernel_print("\r\n");
     }
 
+    current_frame = frame;
+
     status_t result;
     if (eax >= 256 || !syscall_table[eax]) {
         result = STATUS_NOT_IMPLEMENTED;
@@ -87,8 +106,14 @@ void syscall_dispatch(void* frame_ptr) {
 
 // Implementations
 static status_t sys_process_create(uint32_t ebx, uint32_t ecx, uint32_t edx) {
-    (void)ebx; (void)ecx; (void)edx;
+    (void)ecx; (void)edx;
     pcb_t* current = scheduler_get_current();
+    if (ebx & PROCESS_CREATE_CLONE) {
+        pcb_t* child = process_clone(current, current_frame);
+        if (!child) return STATUS_ERROR;
+        scheduler_add_process(child);
+        return (status_t)child->pid;
+    }
     pcb_t* proc = process_create(current ? current->pid : 0);
     if (!proc) return STATUS_ERROR;
     return (status_t)proc->pid;
@@ -111,34 +136,98 @@ static status_t sys_process_kill(uint32_t ebx, uint32_t ecx, uint32_t edx) {
     return process_kill(ebx);
 }
 
+static status_t sys_process_wait(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    (void)edx;
+    // Blocks until child ebx (0 for any) exits; its exit code goes to *ecx
+    pcb_t* current = scheduler_get_current();
+    uint32_t exit_code = 0;
+    status_t result = process_wait(current, ebx, &exit_code);
+    if (result > 0 && ecx) {
+        status_t copied = vmm_copy_to_user(current, ecx, &exit_code, sizeof(exit_code));
+        if (copied != STATUS_SUCCESS) return copied;
+    }
+    return result;
+}
+
+static status_t sys_process_sleep(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    (void)ecx; (void)edx;
+    // ebx microseconds; the PIT fallback rounds up to whole ticks
+    scheduler_sleep(ebx);
+    return STATUS_SUCCESS;
+}
+
 static status_t sys_memory_alloc(uint32_t ebx, uint32_t ecx, uint32_t edx) {
     (void)ecx; (void)edx;
-    uint32_t pages = (ebx + PAGE_SIZE - 1) / PAGE_SIZE;
-    void* ptr = memory_alloc_pages(pages);
-    if (!ptr) return STATUS_OUT_OF_MEMORY;
-    
+    // Reserve address space only; pages are faulted in on first touch
+    uint32_t addr = vmm_alloc_lazy(scheduler_get_current(), ebx);
+    if (!addr) return STATUS_OUT_OF_MEMORY;
+    return (status_t)addr;
+}
+
+static status_t sys_memory_free(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    (void)ecx; (void)edx;
+    return vmm_free(scheduler_get_current(), ebx);
+}
+
+static status_t sys_memory_map(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    // Device pages only, into the caller's device window; SYS_MEMORY_FREE unmaps them
+    return vmm_map_device(scheduler_get_current(), ebx, ecx, edx);
+}
+
+static status_t sys_shm_create(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    (void)edx;
+    // Returns the address in the caller; the handle goes to *ecx for sharing
     pcb_t* current = scheduler_get_current();
-    if (current) {
-        for (uint32_t i = 0; i < pages; i++) {
-            uint32_t addr = (uint32_t)ptr + (i * PAGE_SIZE);
-            memory_map_page(current->page_directory, addr, addr, 0x07);
+    uint32_t id = 0;
+    uint32_t addr = shm_create(current, ebx, &id);
+    if (!addr) return STATUS_OUT_OF_MEMORY;
+    if (ecx) {
+        status_t copied = vmm_copy_to_user(current, ecx, &id, sizeof(id));
+        if (copied != STATUS_SUCCESS) {
+            // Dropping the only mapping frees the object again
+            vmm_free(current, addr);
+            return copied;
         }
     }
-    return (status_t)(uint32_t)ptr;
+    return (status_t)addr;
 }
 
-static status_t sys_memory_free(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+static status_t sys_shm_map(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    (void)edx;
+    // Map object ebx into process ecx (0 for the caller); returns the address there
+    uint32_t addr = shm_map(scheduler_get_current(), ebx, ecx);
+    if (!addr) return STATUS_PERMISSION_DENIED;
+    return (status_t)addr;
+}
+
+static status_t sys_shm_unmap(uint32_t ebx, uint32_t ecx, uint32_t edx) {
     (void)ecx; (void)edx;
-    memory_free_pages((void*)ebx, 1);
-    return STATUS_SUCCESS;
+    return vmm_free(scheduler_get_current(), ebx);
 }
 
-static status_t sys_memory_map(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+static status_t sys_memory_stats(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    (void)edx;
+    // Counters for process ebx (0 for the caller) go to *ecx in one copy.
+    // Other processes' counters need CAP_MEMORY unless they are the caller's children.
+    if (!ecx) return STATUS_INVALID_PARAM;
     pcb_t* current = scheduler_get_current();
-    if (current) {
-        memory_map_page(current->page_directory, ebx, ecx, edx);
+    pcb_t* target = ebx ? process_find(ebx) : current;
+    if (!target) return STATUS_NOT_FOUND;
+    if (target != current && target->parent_pid != current->pid && current->is_user &&
+        capability_check(current->pid, CAP_MEMORY, PERM_READ) != STATUS_SUCCESS) {
+        return STATUS_PERMISSION_DENIED;
     }
-    return STATUS_SUCCESS;
+    memory_stats_t stats;
+    memory_get_process_stats(target, &stats);
+    return vmm_copy_to_user(current, ecx, &stats, sizeof(stats));
+}
+
+static status_t sys_memory_limit(uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    // Resident page quotas for process ebx (0 for the caller): ecx soft, edx hard
+    pcb_t* current = scheduler_get_current();
+    pcb_t* target = ebx ? process_find(ebx) : current;
+    if (!target) return STATUS_NOT_FOUND;
+    return vmm_set_limits(current, target, ecx, edx);
 }
 
 static status_t sys_ipc_send(uint32_t ebx, uint32_t ecx, uint32_t edx) {
@@ -0,0 +1,556 @@
+// Kernel Virtual Memory Manager
+// Per-process region trees: lazy anonymous memory, shared objects, fixed mappings and guard ranges
+
+#include "kernel.h"
+#include "hal.h"
+#include <stddef.h>
+
+// Region nodes come from their own slab cache
+static kmem_cache_t* region_cache = NULL;
+
+// Demand paging statistics
+static uint32_t vmm_faults_resolved = 0;
+static uint32_t vmm_faults_rejected = 0;
+
+// Forward declarations
+static vm_region_t* vmm_find_region(pcb_t* process, uint32_t addr);
+static bool vmm_overlaps(pcb_t* process, uint32_t start, uint32_t pages);
+static status_t vmm_insert(pcb_t* process, uint32_t start, uint32_t pages, uint32_t flags, uint32_t kind);
+static uint32_t vmm_place(pcb_t* process, uint32_t pages);
+static bool vmm_find_gap(vm_region_t* node, uint32_t bytes, uint32_t* cursor);
+static void vmm_release_pages(pcb_t* process, vm_region_t* region);
+static void vmm_destroy_tree(pcb_t* process, vm_region_t* node);
+static status_t vmm_copy_tree(const vm_region_t* src, vm_region_t** dst);
+static vm_region_t* avl_insert(vm_region_t* node, vm_region_t* region);
+static vm_region_t* avl_remove(vm_region_t* node, uint32_t start);
+static bool vmm_charge(pcb_t* process, uint32_t pages);
+
+static inline uint32_t region_end(const vm_region_t* region) {
+    return region->start + region->pages * PAGE_SIZE;
+}
+
+// A limit of 0 means none, so anything else is tighter than it
+static inline bool vmm_limit_tightens(uint32_t old_limit, uint32_t new_limit) {
+    return new_limit == old_limit || (new_limit != 0 && (old_limit == 0 || new_limit < old_limit));
+}
+
+// Initialize the region cache
+void vmm_init(void) {
+    region_cache = kmem_cache_create("vm_region", sizeof(vm_region_t), NULL);
+    if (!region_cache) {
+        kernel_panic("Cannot create region cache");
+    }
+}
+
+// Reserve a lazily backed region in the user heap window
+uint32_t vmm_alloc_lazy(pcb_t* process, uint32_t size) {
+    if (!process || size == 0) {
+        return 0;
+    }
+
+    uint32_t pages = DIV_ROUND_UP(size, PAGE_SIZE);
+
+    // Over the soft limit no new regions are handed out; over the hard limit they could never be backed
+    if (process->mem_soft_limit && process->resident_pages >= process->mem_soft_limit) {
+        return 0;
+    }
+    if (process->mem_hard_limit && pages > process->mem_hard_limit) {
+        return 0;
+    }
+
+    uint32_t start = vmm_place(process, pages);
+
+    // Present, RW, User, no execute once faulted in
+    if (!start || vmm_insert(process, start, pages, 0x07 | PAGE_NX, VMA_LAZY) != STATUS_SUCCESS) {
+        return 0;
+    }
+    return start;
+}
+
+// Reserve a lazily backed region at a fixed address (the user stack)
+status_t vmm_alloc_fixed(pcb_t* process, uint32_t virt_addr, uint32_t pages, uint32_t flags) {
+    if (!process || pages == 0 || (virt_addr & 0xFFF)) {
+        return STATUS_INVALID_PARAM;
+    }
+    if (vmm_overlaps(process, virt_addr, pages)) {
+        return STATUS_ALREADY_EXISTS;
+    }
+    return vmm_insert(process, virt_addr, pages, flags, VMA_LAZY);
+}
+
+// Map every frame of a shared memory object into the heap window
+uint32_t vmm_map_shared(pcb_t* process, shm_object_t* object) {
+    if (!process || !object) {
+        return 0;
+    }
+
+    uint32_t start = vmm_place(process, object->pages);
+    uint32_t flags = 0x07 | PAGE_NX | PAGE_SHARED;
+    if (!start || !vmm_charge(process, object->pages)) {
+        return 0;
+    }
+    if (vmm_insert(process, start, object->pages, flags, VMA_SHARED) != STATUS_SUCCESS) {
+        process->resident_pages -= object->pages;
+        return 0;
+    }
+    vmm_find_region(process, start)->object = object;
+    shm_get(object);
+
+    // Each mapping holds its own reference on every frame
+    for (uint32_t i = 0; i < object->pages; i++) {
+        memory_page_get(object->frames[i]);
+        memory_map_page(process->page_directory, start + i * PAGE_SIZE, object->frames[i], flags);
+    }
+    return start;
+}
+
+// Map frames that exist up front (program image, stack) and track them as one region
+status_t vmm_map_fixed(pcb_t* process, uint32_t virt_addr, uint32_t phys_addr, uint32_t pages, uint32_t flags) {
+    if (!process || pages == 0 || (virt_addr & 0xFFF) || (phys_addr & 0xFFF)) {
+        return STATUS_INVALID_PARAM;
+    }
+    if (vmm_overlaps(process, virt_addr, pages)) {
+        return STATUS_ALREADY_EXISTS;
+    }
+    if (!vmm_charge(process, pages)) {
+        return STATUS_OUT_OF_MEMORY;
+    }
+
+    status_t status = vmm_insert(process, virt_addr, pages, flags, VMA_MAPPED);
+    if (status == STATUS_SUCCESS) {
+        memory_map_range(process->page_directory, virt_addr, phys_addr, pages, flags);
+    } else {
+        process->resident_pages -= pages;
+    }
+    return status;
+}
+
+// Map one device page for a driver; RAM the allocator hands out is refused
+status_t vmm_map_device(pcb_t* process, uint32_t virt_addr, uint32_t phys_addr, uint32_t flags) {
+    if (!process) {
+        return STATUS_INVALID_PARAM;
+    }
+    if (process->is_user && capability_check(process->pid, CAP_HARDWARE, 0) != STATUS_SUCCESS) {
+        return STATUS_PERMISSION_DENIED;
+    }
+    if (virt_addr < USER_DEVICE_BASE || virt_addr >= USER_DEVICE_END || !memory_is_device(phys_addr)) {
+        return STATUS_PERMISSION_DENIED;
+    }
+
+    // Caller picks RW and caching (PWT/PCD) only; a forked child shares the device
+    return vmm_map_fixed(process, virt_addr, phys_addr, 1, 0x05 | (flags & 0x1A) | PAGE_NX | PAGE_SHARED);
+}
+
+// Hold address space with no access, so faults there are caught as overruns
+status_t vmm_reserve(pcb_t* process, uint32_t virt_addr, uint32_t pages) {
+    if (!process || pages == 0 || (virt_addr & 0xFFF)) {
+        return STATUS_INVALID_PARAM;
+    }
+    if (vmm_overlaps(process, virt_addr, pages)) {
+        return STATUS_ALREADY_EXISTS;
+    }
+    return vmm_insert(process, virt_addr, pages, 0, VMA_RESERVED);
+}
+
+// Release a heap or device region and every frame mapped into it
+status_t vmm_free(pcb_t* process, uint32_t addr) {
+    if (!process) {
+        return STATUS_INVALID_PARAM;
+    }
+
+    // The image, stack and guard pages live outside these windows and stay put
+    vm_region_t* region = vmm_find_region(process, addr);
+    if (!region || region->start != addr || addr < USER_HEAP_BASE || addr >= USER_DEVICE_END) {
+        return STATUS_NOT_FOUND;
+    }
+
+    vmm_release_pages(process, region);
+    process->regions = avl_remove(process->regions, addr);
+    process->region_count--;
+    kmem_cache_free(region_cache, region);
+
+    return STATUS_SUCCESS;
+}
+
+// Release every region of an exiting process
+void vmm_destroy(pcb_t* process) {
+    if (!process) {
+        return;
+    }
+    vmm_destroy_tree(process, process->regions);
+    process->regions = NULL;
+    process->region_count = 0;
+}
+
+// Release one region of an exiting process; false once none are left
+bool vmm_destroy_step(pcb_t* process) {
+    if (!process || !process->regions) {
+        return false;
+    }
+    vm_region_t* region = process->regions;
+    vmm_release_pages(process, region);
+    process->regions = avl_remove(process->regions, region->start);
+    process->region_count--;
+    kmem_cache_free(region_cache, region);
+    return process->regions != NULL;
+}
+
+// Give a forked child its own copy of the parent's regions
+status_t vmm_clone(pcb_t* parent, pcb_t* child) {
+    if (!parent || !child) {
+        return STATUS_INVALID_PARAM;
+    }
+    // Every page the parent has mapped is now mapped in the child too
+    child->region_count = parent->region_count;
+    child->resident_pages = parent->resident_pages;
+    return vmm_copy_tree(parent->regions, &child->regions);
+}
+
+// Resolve a page fault; false means the access is invalid
+bool vmm_handle_fault(pcb_t* process, uint32_t fault_addr, uint32_t err_code) {
+    if (!process) {
+        vmm_faults_rejected++;
+        return false;
+    }
+
+    // Protection faults on present pages are only valid as copy-on-write breaks
+    if (err_code & 0x01) {
+        if ((err_code & 0x02) && memory_resolve_cow(process->page_directory, fault_addr, process->pid)) {
+            vmm_faults_resolved++;
+            return true;
+        }
+        vmm_faults_rejected++;
+        return false;
+    }
+
+    vm_region_t* region = vmm_find_region(process, fault_addr);
+    if (!region || region->kind != VMA_LAZY) {
+        if (region && region->kind == VMA_RESERVED) {
+            kernel_print("vmm: guard page hit at ");
+            kernel_print_hex(fault_addr);
+            kernel_print("\r\n");
+        }
+        vmm_faults_rejected++;
+        return false;
+    }
+
+    if (!vmm_charge(process, 1)) {
+        vmm_faults_rejected++;
+        return false;
+    }
+    void* frame = memory_alloc_pages_flags(1, ALLOC_ZERO);
+    if (!frame) {
+        kernel_print("vmm: out of memory on demand fault\r\n");
+        process->resident_pages--;
+        vmm_faults_rejected++;
+        return false;
+    }
+    memory_tag_pages(frame, 1, MEM_TYPE_USER, process->pid);
+
+    memory_map_page(process->page_directory, fault_addr & ~0xFFF, (uint32_t)frame, region->flags);
+    vmm_faults_resolved++;
+    return true;
+}
+
+// Get demand paging statistics
+void vmm_get_stats(uint32_t* faults_resolved, uint32_t* faults_rejected) {
+    if (faults_resolved) *faults_resolved = vmm_faults_resolved;
+    if (faults_rejected) *faults_rejected = vmm_faults_rejected;
+}
+
+// Set a process's resident page quotas (0 for none). Without CAP_MEMORY a user
+// process may only tighten the limits of itself or its children.
+status_t vmm_set_limits(pcb_t* caller, pcb_t* target, uint32_t soft_pages, uint32_t hard_pages) {
+    if (!caller || !target) {
+        return STATUS_INVALID_PARAM;
+    }
+    if (hard_pages && soft_pages > hard_pages) {
+        return STATUS_INVALID_PARAM;
+    }
+
+    if (caller->is_user && capability_check(caller->pid, CAP_MEMORY, PERM_WRITE) != STATUS_SUCCESS) {
+        if (target != caller && target->parent_pid != caller->pid) {
+            return STATUS_PERMISSION_DENIED;
+        }
+        if (!vmm_limit_tightens(target->mem_soft_limit, soft_pages) ||
+            !vmm_limit_tightens(target->mem_hard_limit, hard_pages)) {
+            return STATUS_PERMISSION_DENIED;
+        }
+    }
+
+    target->mem_soft_limit = soft_pages;
+    target->mem_hard_limit = hard_pages;
+    return STATUS_SUCCESS;
+}
+
+// Copy size bytes out to dest in the process's address space, which must be
+// the active one. The range must lie above the kernel identity map, below the
+// user stack top, and inside writable regions; absent pages fault in on the copy.
+status_t vmm_copy_to_user(pcb_t* process, uint32_t dest, const void* src, uint32_t size) {
+    if (!process || !src || process->page_directory != hal_cpu_get_cr3()) {
+        return STATUS_INVALID_PARAM;
+    }
+    if (dest < USER_HEAP_BASE || dest > USER_STACK_TOP || size > USER_STACK_TOP - dest) {
+        return STATUS_PERMISSION_DENIED;
+    }
+
+    uint32_t end = dest + size;
+    for (uint32_t addr = dest; addr < end; ) {
+        vm_region_t* region = vmm_find_region(process, addr);
+        if (!region || region->kind == VMA_RESERVED || !(region->flags & 0x02)) {
+            return STATUS_PERMISSION_DENIED;
+        }
+        addr = region_end(region);
+    }
+    __builtin_memcpy((void*)dest, src, size);
+    return STATUS_SUCCESS;
+}
+
+// Find the region containing addr
+static vm_region_t* vmm_find_region(pcb_t* process, uint32_t addr) {
+    vm_region_t* node = process->regions;
+    while (node) {
+        if (addr < node->start) {
+            node = node->left;
+        } else if (addr >= region_end(node)) {
+            node = node->right;
+        } else {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// Check whether [start, start + pages) touches any region
+static bool vmm_overlaps(pcb_t* process, uint32_t start, uint32_t pages) {
+    uint32_t end = start + pages * PAGE_SIZE;
+    vm_region_t* node = process->regions;
+    while (node) {
+        if (end <= node->start) {
+            node = node->left;
+        } else if (start >= region_end(node)) {
+            node = node->right;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+static status_t vmm_insert(pcb_t* process, uint32_t start, uint32_t pages, uint32_t flags, uint32_t kind) {
+    vm_region_t* region = (vm_region_t*)kmem_cache_alloc(region_cache);
+    if (!region) {
+        return STATUS_OUT_OF_MEMORY;
+    }
+    region->start = start;
+    region->pages = pages;
+    region->flags = flags;
+    region->kind = kind;
+    region->object = NULL;
+    region->left = NULL;
+    region->right = NULL;
+    region->height = 1;
+
+    process->regions = avl_insert(process->regions, region);
+    process->region_count++;
+    return STATUS_SUCCESS;
+}
+
+// First fit for pages in the heap window; returns 0 when nothing fits
+static uint32_t vmm_place(pcb_t* process, uint32_t pages) {
+    if (pages == 0 || pages > (USER_HEAP_END - USER_HEAP_BASE) / PAGE_SIZE) {
+        return 0;
+    }
+    uint32_t bytes = pages * PAGE_SIZE;
+    uint32_t start = USER_HEAP_BASE;
+    if (!vmm_find_gap(process->regions, bytes, &start) &&
+        (start >= USER_HEAP_END || USER_HEAP_END - start < bytes)) {
+        return 0;
+    }
+    return start;
+}
+
+// In-order walk for the lowest heap gap of bytes at or above *cursor.
+// Subtrees that end below the cursor are skipped.
+static bool vmm_find_gap(vm_region_t* node, uint32_t bytes, uint32_t* cursor) {
+    if (!node) {
+        return false;
+    }
+    if (region_end(node) > *cursor) {
+        if (vmm_find_gap(node->left, bytes, cursor)) {
+            return true;
+        }
+        uint32_t limit = (node->start < USER_HEAP_END) ? node->start : USER_HEAP_END;
+        if (limit >= *cursor && limit - *cursor >= bytes) {
+            return true;
+        }
+        *cursor = region_end(node);
+        if (*cursor >= USER_HEAP_END) {
+            return false;
+        }
+    }
+    return vmm_find_gap(node->right, bytes, cursor);
+}
+
+// Count pages about to be mapped against the process's quotas; false past the hard limit
+static bool vmm_charge(pcb_t* process, uint32_t pages) {
+    uint32_t resident = process->resident_pages + pages;
+    if (process->mem_hard_limit && resident > process->mem_hard_limit) {
+        kernel_print("vmm: hard memory limit reached by PID ");
+        kernel_print_hex(process->pid);
+        kernel_print("\r\n");
+        return false;
+    }
+    if (process->mem_soft_limit && process->resident_pages <= process->mem_soft_limit &&
+        resident > process->mem_soft_limit) {
+        kernel_print("vmm: soft memory limit passed by PID ");
+        kernel_print_hex(process->pid);
+        kernel_print("\r\n");
+    }
+    process->resident_pages = resident;
+    return true;
+}
+
+// Release the frames mapped in a region and drop their mappings
+static void vmm_release_pages(pcb_t* process, vm_region_t* region) {
+    if (region->kind == VMA_RESERVED) {
+        return;
+    }
+    for (uint32_t i = 0; i < region->pages; i++) {
+        uint32_t pte = memory_get_pte(process->page_directory, region->start + i * PAGE_SIZE);
+        if (pte & 0x01) {
+            memory_page_put(pte & ~0xFFF);
+            process->resident_pages--;
+        }
+    }
+    memory_unmap_range(process->page_directory, region->start, region->pages);
+    if (region->kind == VMA_SHARED) {
+        shm_put(region->object);
+    }
+}
+
+static void vmm_destroy_tree(pcb_t* process, vm_region_t* node) {
+    if (!node) {
+        return;
+    }
+    vmm_destroy_tree(process, node->left);
+    vmm_destroy_tree(process, node->right);
+    vmm_release_pages(process, node);
+    kmem_cache_free(region_cache, node);
+}
+
+// Copy a subtree; on failure the copied part stays linked for the caller to destroy
+static status_t vmm_copy_tree(const vm_region_t* src, vm_region_t** dst) {
+    *dst = NULL;
+    if (!src) {
+        return STATUS_SUCCESS;
+    }
+    vm_region_t* node = (vm_region_t*)kmem_cache_alloc(region_cache);
+    if (!node) {
+        return STATUS_OUT_OF_MEMORY;
+    }
+    *node = *src;
+    *dst = node;
+    if (node->kind == VMA_SHARED) {
+        shm_get(node->object);
+    }
+
+    status_t status = vmm_copy_tree(src->left, &node->left);
+    if (status == STATUS_SUCCESS) {
+        status = vmm_copy_tree(src->right, &node->right);
+    } else {
+        node->right = NULL;
+    }
+    return status;
+}
+
+// AVL helpers
+static inline int32_t avl_height(vm_region_t* node) {
+    return node ? node->height : 0;
+}
+
+static void avl_update(vm_region_t* node) {
+    int32_t left = avl_height(node->left);
+    int32_t right = avl_height(node->right);
+    node->height = 1 + (left > right ? left : right);
+}
+
+static vm_region_t* avl_rotate_right(vm_region_t* node) {
+    vm_region_t* pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    avl_update(node);
+    avl_update(pivot);
+    return pivot;
+}
+
+static vm_region_t* avl_rotate_left(vm_region_t* node) {
+    vm_region_t* pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    avl_update(node);
+    avl_update(pivot);
+    return pivot;
+}
+
+static vm_region_t* avl_balance(vm_region_t* node) {
+    avl_update(node);
+    int32_t balance = avl_height(node->left) - avl_height(node->right);
+    if (balance > 1) {
+        if (avl_height(node->left->left) < avl_height(node->left->right)) {
+            node->left = avl_rotate_left(node->left);
+        }
+        return avl_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (avl_height(node->right->right) < avl_height(node->right->left)) {
+            node->right = avl_rotate_right(node->right);
+        }
+        return avl_rotate_left(node);
+    }
+    return node;
+}
+
+static vm_region_t* avl_insert(vm_region_t* node, vm_region_t* region) {
+    if (!node) {
+        return region;
+    }
+    if (region->start < node->start) {
+        node->left = avl_insert(node->left, region);
+    } else {
+        node->right = avl_insert(node->right, region);
+    }
+    return avl_balance(node);
+}
+
+// Unlink the lowest node of a subtree into *min
+static vm_region_t* avl_remove_min(vm_region_t* node, vm_region_t** min) {
+    if (!node->left) {
+        *min = node;
+        return node->right;
+    }
+    node->left = avl_remove_min(node->left, min);
+    return avl_balance(node);
+}
+
+// Unlink the node starting at start; the node itself is left to the caller
+static vm_region_t* avl_remove(vm_region_t* node, uint32_t start) {
+    if (!node) {
+        return NULL;
+    }
+    if (start < node->start) {
+        node->left = avl_remove(node->left, start);
+    } else if (start > node->start) {
+        node->right = avl_remove(node->right, start);
+    } else {
+        if (!node->left || !node->right) {
+            return node->left ? node->left : node->right;
+        }
+        vm_region_t* successor;
+        vm_region_t* right = avl_remove_min(node->right, &successor);
+        successor->left = node->left;
+        successor->right = right;
+        node = successor;
+    }
+    return avl_balance(node);
+}
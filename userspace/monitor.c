@@ -108,23 +108,44 @@ static void display_process_info(void) {
 static void display_memory_info(void) {
     print("=== MEMORY INFORMATION ===\r\n");
     
-    // Get memory stats (this would be a system call in real implementation)
-    print("Physical Memory:\r\n");
-    print("  Total: 16 MB (16384 KB)\r\n");
-    print("  Used:  4 MB (4096 KB)\r\n");
-    print("  Free:  12 MB (12288 KB)\r\n");
-    print("  Usage: 25%\r\n");
-    
-    print("\nVirtual Memory:\r\n");
-    print("  Page Size: 4 KB\r\n");
-    print("  Total Pages: 4096\r\n");
-    print("  Used Pages: 1024\r\n");
-    print("  Free Pages: 3072\r\n");
-    
-    print("\nMemory Allocation:\r\n");
-    print("  Kernel: 2 MB\r\n");
-    print("  Drivers: 1 MB\r\n");
-    print("  User Space: 1 MB\r\n");
+    static const char* type_names[MEM_TYPE_COUNT] = {
+        "Kernel", "Page Tables", "Stacks", "IPC", "User", "Capabilities", "Slab", "Shared"
+    };
+    
+    memory_stats_t stats;
+    if (memory_stats(0, &stats) != 0) {
+        print("Memory stats unavailable\r\n\r\n");
+        return;
+    }
+    
+    // Counts are in pages of 4 KB
+    print("Physical Memory (pages):\r\n");
+    print("  Total: "); print_hex(stats.total_pages); print("\r\n");
+    print("  Used:  "); print_hex(stats.used_pages); print("\r\n");
+    print("  Free:  "); print_hex(stats.total_pages - stats.used_pages); print("\r\n");
+    
+    print("\nZones (pages free / present, min low high watermarks, lowest free):\r\n");
+    for (int i = 0; i < MEM_ZONE_COUNT; i++) {
+        memory_zone_stats_t* zone = &stats.zones[i];
+        print(i == MEM_ZONE_DMA ? "  DMA: " : "  Normal: ");
+        print_hex(zone->free_pages); print(" / "); print_hex(zone->present_pages); print(", ");
+        print_hex(zone->watermark_min); print(" "); print_hex(zone->watermark_low); print(" ");
+        print_hex(zone->watermark_high); print(", "); print_hex(zone->lowest_free); print("\r\n");
+    }
+    
+    print("\nMemory Allocation (pages):\r\n");
+    for (int i = 0; i < MEM_TYPE_COUNT; i++) {
+        print("  "); print(type_names[i]); print(": ");
+        print_hex(stats.pages_by_type[i]); print("\r\n");
+    }
+    
+    print("\nThis Process (pages):\r\n");
+    print("  Resident: "); print_hex(stats.resident_pages); print("\r\n");
+    print("  Page Tables: "); print_hex(stats.page_table_pages); print("\r\n");
+    print("  Regions: "); print_hex(stats.regions); print("\r\n");
+    print("  IPC Queued (bytes): "); print_hex(stats.ipc_bytes); print("\r\n");
+    print("  Limits: "); print_hex(stats.soft_limit); print(" soft, ");
+    print_hex(stats.hard_limit); print(" hard\r\n");
     
     print("\r\n");
 }
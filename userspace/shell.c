@@ -268,10 +268,19 @@ static int cmd_kill(int argc, char* argv[]) {
 
 static int cmd_mem(int argc, char* argv[]) {
     (void)argc; (void)argv;  // Suppress unused parameter warnings
+    memory_stats_t stats;
+    if (memory_stats(0, &stats) != 0) {
+        print("Memory stats unavailable\r\n");
+        return 1;
+    }
+    
+    // Sizes in KB
     print("Memory Usage:\r\n");
-    print("Total: 16MB\r\n");
-    print("Used:  4MB\r\n");
-    print("Free:  12MB\r\n");
+    print("Total: "); print_hex(stats.total_pages * 4); print(" KB\r\n");
+    print("Used:  "); print_hex(stats.used_pages * 4); print(" KB\r\n");
+    print("Free:  "); print_hex((stats.total_pages - stats.used_pages) * 4); print(" KB\r\n");
+    print("Shell: "); print_hex(stats.resident_pages * 4); print(" KB resident, ");
+    print_hex(stats.page_table_pages * 4); print(" KB page tables\r\n");
     return 0;
 }
 
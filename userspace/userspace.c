@@ -2,6 +2,7 @@
 // Common functions used by user-space programs
 
 #include "userspace.h"
+#include "string_ops.h"
 
 // String functions
 uint32_t strlen(const char* str) {
@@ -40,19 +41,12 @@ int strcmp(const char* str1, const char* str2) {
 }
 
 void* memset(void* ptr, int value, uint32_t size) {
-    uint8_t* p = (uint8_t*)ptr;
-    while (size--) {
-        *p++ = (uint8_t)value;
-    }
+    string_fill(ptr, (uint8_t)value, size);
     return ptr;
 }
 
 void* memcpy(void* dest, const void* src, uint32_t size) {
-    uint8_t* d = (uint8_t*)dest;
-    const uint8_t* s = (const uint8_t*)src;
-    while (size--) {
-        *d++ = *s++;
-    }
+    string_copy(dest, src, size);
     return dest;
 }
 
@@ -78,28 +72,250 @@ void print_hex(uint32_t value) {
     print(buffer);
 }
 
-// Sleep function
+// Sleep function; the kernel keeps the timer, so no driver round trip is needed
 void sleep(uint32_t ms) {
-    // Request timer driver to sleep
-    ipc_abi_message_t msg = {0};
-    msg.msg_type = DRIVER_MSG_IOCTL;
-    msg.data_size = 3 * sizeof(uint32_t);
-    uint32_t* data = (uint32_t*)msg.data;
-    data[0] = 0x03;  // Set delay request
-    data[1] = ms;    // Delay in milliseconds
-    data[2] = 0;     // Unused
-    
-    uint32_t request_id = driver_request(4, &msg);  // Timer driver PID
-    
-    if (request_id != 0) {
-        // Wait for timer notification
-        ipc_abi_message_t response = {0};
-        while (ipc_receive(0, &response, true) == 0) {  // STATUS_SUCCESS
-            if (response.msg_type == DRIVER_MSG_IOCTL && 
-                response.data_size >= sizeof(uint32_t) &&
-                *(uint32_t*)response.data == request_id) {
-                break;
+    process_sleep(ms * 1000);
+}
+
+void usleep(uint32_t us) {
+    process_sleep(us);
+}
+
+// Heap allocator
+// Small objects come from size-class pages and larger ones from page spans,
+// both carved out of big lazily backed chunks taken from SYS_MEMORY_ALLOC.
+// Anything bigger than half a chunk gets a kernel region of its own.
+
+#define HEAP_PAGE_SIZE   4096
+#define HEAP_CHUNK_PAGES 64                                 // 256KB per chunk, page 0 is the header
+#define HEAP_CHUNK_SIZE  (HEAP_CHUNK_PAGES * HEAP_PAGE_SIZE)
+#define HEAP_MIN_SHIFT   4                                  // Smallest class: 16 bytes
+#define HEAP_MAX_SHIFT   11                                 // Largest class: 2048 bytes
+#define HEAP_CLASSES     (HEAP_MAX_SHIFT - HEAP_MIN_SHIFT + 1)
+#define HEAP_SPAN_MAX    (HEAP_CHUNK_SIZE / 2)
+#define HEAP_OFFSET_NONE 0xFFFF
+
+// Page states in a chunk
+#define HEAP_PAGE_FREE   0
+#define HEAP_PAGE_SMALL  1   // Objects of one size class
+#define HEAP_PAGE_SPAN   2   // First page of a large allocation
+#define HEAP_PAGE_TAIL   3   // Later pages of a large allocation
+
+typedef struct heap_page {
+    struct heap_page* next;    // Partial pages of the same class
+    struct heap_page* prev;
+    uint16_t free_offset;      // First free object in the page
+    uint16_t used;             // Objects handed out
+    uint8_t state;             // HEAP_PAGE_*
+    uint8_t size_class;        // Class index for HEAP_PAGE_SMALL
+    uint16_t span_pages;       // Length of a HEAP_PAGE_SPAN allocation
+} heap_page_t;
+
+typedef struct heap_chunk {
+    struct heap_chunk* next;
+    uint32_t used_pages;       // Pages that are not HEAP_PAGE_FREE
+    heap_page_t pages[HEAP_CHUNK_PAGES];
+} heap_chunk_t;
+
+static heap_chunk_t* heap_chunks = NULL;
+static heap_page_t* heap_partial[HEAP_CLASSES];
+static uint32_t heap_empty_chunks = 0;
+
+static inline uint8_t* heap_page_addr(heap_chunk_t* chunk, heap_page_t* page) {
+    return (uint8_t*)chunk + (uint32_t)(page - chunk->pages) * HEAP_PAGE_SIZE;
+}
+
+// Find the chunk holding ptr
+static heap_chunk_t* heap_find_chunk(void* ptr) {
+    for (heap_chunk_t* chunk = heap_chunks; chunk; chunk = chunk->next) {
+        if ((uint8_t*)ptr > (uint8_t*)chunk && (uint8_t*)ptr < (uint8_t*)chunk + HEAP_CHUNK_SIZE) {
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+// Get a new chunk from the kernel; its pages are only backed once touched
+static heap_chunk_t* heap_add_chunk(void) {
+    uint32_t addr = memory_region_alloc(HEAP_CHUNK_SIZE);
+    if ((int32_t)addr <= 0) {
+        return NULL;
+    }
+    heap_chunk_t* chunk = (heap_chunk_t*)addr;
+    chunk->pages[0].state = HEAP_PAGE_TAIL;  // Header page
+    chunk->used_pages = 0;
+    chunk->next = heap_chunks;
+    heap_chunks = chunk;
+    heap_empty_chunks++;
+    return chunk;
+}
+
+// Reserve count consecutive pages, first fit over the chunks
+static heap_page_t* heap_take_pages(uint32_t count, heap_chunk_t** owner) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (heap_chunk_t* chunk = heap_chunks; chunk; chunk = chunk->next) {
+            if (HEAP_CHUNK_PAGES - 1 - chunk->used_pages < count) {
+                continue;
+            }
+            uint32_t run = 0;
+            for (uint32_t i = 1; i < HEAP_CHUNK_PAGES; i++) {
+                run = (chunk->pages[i].state == HEAP_PAGE_FREE) ? run + 1 : 0;
+                if (run == count) {
+                    heap_page_t* first = &chunk->pages[i + 1 - count];
+                    for (uint32_t j = 1; j < count; j++) {
+                        first[j].state = HEAP_PAGE_TAIL;
+                    }
+                    if (chunk->used_pages == 0) {
+                        heap_empty_chunks--;
+                    }
+                    chunk->used_pages += count;
+                    *owner = chunk;
+                    return first;
+                }
             }
         }
+        if (attempt == 0 && !heap_add_chunk()) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Give pages back to their chunk; a second empty chunk goes back to the kernel
+static void heap_release_pages(heap_chunk_t* chunk, heap_page_t* first, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        first[i].state = HEAP_PAGE_FREE;
+    }
+    chunk->used_pages -= count;
+    if (chunk->used_pages > 0) {
+        return;
+    }
+
+    if (heap_empty_chunks == 0) {
+        heap_empty_chunks++;  // Keep one around for the next burst
+        return;
+    }
+    heap_chunk_t** link = &heap_chunks;
+    while (*link != chunk) {
+        link = &(*link)->next;
+    }
+    *link = chunk->next;
+    memory_region_free(chunk);
+}
+
+static void heap_partial_remove(heap_page_t* page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        heap_partial[page->size_class] = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+}
+
+static void heap_partial_push(heap_page_t* page) {
+    page->prev = NULL;
+    page->next = heap_partial[page->size_class];
+    if (page->next) {
+        page->next->prev = page;
+    }
+    heap_partial[page->size_class] = page;
+}
+
+// Allocate from the smallest fitting class, a page span, or a region of its own
+void* memory_alloc(uint32_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size > HEAP_SPAN_MAX) {
+        uint32_t addr = memory_region_alloc(size);
+        return ((int32_t)addr <= 0) ? NULL : (void*)addr;
+    }
+
+    heap_chunk_t* chunk;
+    if (size > (1U << HEAP_MAX_SHIFT)) {
+        uint32_t count = DIV_ROUND_UP(size, HEAP_PAGE_SIZE);
+        heap_page_t* span = heap_take_pages(count, &chunk);
+        if (!span) {
+            return NULL;
+        }
+        span->state = HEAP_PAGE_SPAN;
+        span->span_pages = count;
+        return heap_page_addr(chunk, span);
+    }
+
+    uint32_t size_class = 0;
+    while ((1U << (HEAP_MIN_SHIFT + size_class)) < size) {
+        size_class++;
+    }
+    uint32_t object_size = 1U << (HEAP_MIN_SHIFT + size_class);
+
+    heap_page_t* page = heap_partial[size_class];
+    if (page) {
+        chunk = heap_find_chunk(page);
+    } else {
+        // Thread a fresh page into a free list of objects
+        page = heap_take_pages(1, &chunk);
+        if (!page) {
+            return NULL;
+        }
+        uint8_t* base = heap_page_addr(chunk, page);
+        for (uint32_t offset = 0; offset < HEAP_PAGE_SIZE; offset += object_size) {
+            uint32_t next = offset + object_size;
+            *(uint16_t*)(base + offset) = (next < HEAP_PAGE_SIZE) ? (uint16_t)next : HEAP_OFFSET_NONE;
+        }
+        page->state = HEAP_PAGE_SMALL;
+        page->size_class = size_class;
+        page->free_offset = 0;
+        page->used = 0;
+        heap_partial_push(page);
+    }
+
+    uint8_t* object = heap_page_addr(chunk, page) + page->free_offset;
+    page->free_offset = *(uint16_t*)object;
+    page->used++;
+    if (page->free_offset == HEAP_OFFSET_NONE) {
+        heap_partial_remove(page);
+    }
+    return object;
+}
+
+// Free memory returned by memory_alloc
+void memory_free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    heap_chunk_t* chunk = heap_find_chunk(ptr);
+    if (!chunk) {
+        memory_region_free(ptr);
+        return;
+    }
+
+    uint32_t offset = (uint8_t*)ptr - (uint8_t*)chunk;
+    heap_page_t* page = &chunk->pages[offset / HEAP_PAGE_SIZE];
+
+    if (page->state == HEAP_PAGE_SPAN) {
+        heap_release_pages(chunk, page, page->span_pages);
+        return;
+    }
+    if (page->state != HEAP_PAGE_SMALL) {
+        return;  // Not an allocation start
+    }
+
+    bool was_full = (page->free_offset == HEAP_OFFSET_NONE);
+    *(uint16_t*)ptr = page->free_offset;
+    page->free_offset = offset % HEAP_PAGE_SIZE;
+    page->used--;
+
+    if (page->used == 0) {
+        if (!was_full) {
+            heap_partial_remove(page);
+        }
+        heap_release_pages(chunk, page, 1);
+    } else if (was_full) {
+        heap_partial_push(page);
     }
 }